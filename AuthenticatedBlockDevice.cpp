@@ -0,0 +1,340 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 2018 GreenWaves Technologies
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "AuthenticatedBlockDevice.h"
+
+#define AUTH_CACHE_ENTRIES  MBED_CONF_HYPERBUSF_DRIVER_AUTH_CACHE_ENTRIES
+#define AUTH_HMAC_SIZE      32
+
+
+AuthenticatedBlockDevice::AuthenticatedBlockDevice(BlockDevice *bd, const void *key, size_t key_size) :
+    _bd(bd), _key_size(key_size),
+    _unit_size(0), _unit_pages(0), _data_pages(0), _size(0), _cache(NULL)
+{
+    MBED_ASSERT(key_size <= AUTH_KEY_SIZE);
+    memcpy(_key, key, key_size);
+    memset(_verified, 0, sizeof(_verified));
+    mbedtls_md_init(&_md);
+}
+
+AuthenticatedBlockDevice::~AuthenticatedBlockDevice()
+{
+    delete[] _cache;
+    mbedtls_md_free(&_md);
+    memset(_key, 0, sizeof(_key));
+}
+
+int AuthenticatedBlockDevice::init()
+{
+    int err = _bd->init();
+    if (err) {
+        return err;
+    }
+
+    // Split every erase unit into data pages followed by their MACs
+    _unit_size = _bd->get_erase_size();
+    MBED_ASSERT(_unit_size % AUTH_PAGE_SIZE == 0);
+    MBED_ASSERT(AUTH_MAC_SIZE % _bd->get_program_size() == 0);
+
+    _unit_pages = _unit_size / AUTH_PAGE_SIZE;
+    _data_pages = (_unit_pages * AUTH_PAGE_SIZE) / (AUTH_PAGE_SIZE + AUTH_MAC_SIZE);
+    while (_data_pages * AUTH_MAC_SIZE > (_unit_pages - _data_pages) * AUTH_PAGE_SIZE) {
+        _data_pages--;
+    }
+    _size = (_bd->size() / _unit_size) * _data_pages * AUTH_PAGE_SIZE;
+
+    // Key the HMAC once, each page only needs a reset
+    mbedtls_md_free(&_md);
+    mbedtls_md_init(&_md);
+    err = mbedtls_md_setup(&_md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1);
+    if (!err) {
+        err = mbedtls_md_hmac_starts(&_md, _key, _key_size);
+    }
+    if (!err && !_cache) {
+        _cache = new (std::nothrow) uint8_t[AUTH_CACHE_ENTRIES * AUTH_PAGE_SIZE];
+    }
+    if (err || !_cache) {
+        _bd->deinit();
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    memset(_verified, 0, sizeof(_verified));
+    return 0;
+}
+
+int AuthenticatedBlockDevice::deinit()
+{
+    mbedtls_md_free(&_md);
+    mbedtls_md_init(&_md);
+    memset(_verified, 0, sizeof(_verified));
+    delete[] _cache;
+    _cache = NULL;
+
+    return _bd->deinit();
+}
+
+int AuthenticatedBlockDevice::sync()
+{
+    return _bd->sync();
+}
+
+bd_addr_t AuthenticatedBlockDevice::_page_addr(uint32_t page) const
+{
+    return (bd_addr_t)(page / _data_pages) * _unit_size
+         + (bd_addr_t)(page % _data_pages) * AUTH_PAGE_SIZE;
+}
+
+bd_addr_t AuthenticatedBlockDevice::_mac_addr(uint32_t page) const
+{
+    return (bd_addr_t)(page / _data_pages) * _unit_size
+         + (bd_addr_t)_data_pages * AUTH_PAGE_SIZE
+         + (bd_addr_t)(page % _data_pages) * AUTH_MAC_SIZE;
+}
+
+int AuthenticatedBlockDevice::_compute_mac(uint32_t page, const void *data, uint8_t *mac)
+{
+    uint8_t index[4] = {
+        (uint8_t)(page >> 0), (uint8_t)(page >> 8),
+        (uint8_t)(page >> 16), (uint8_t)(page >> 24),
+    };
+    uint8_t hmac[AUTH_HMAC_SIZE];
+
+    // Bind the MAC to the page index so pages can't be swapped around
+    int err = mbedtls_md_hmac_reset(&_md);
+    if (!err) {
+        err = mbedtls_md_hmac_update(&_md, index, sizeof(index));
+    }
+    if (!err) {
+        err = mbedtls_md_hmac_update(&_md, (const unsigned char *)data, AUTH_PAGE_SIZE);
+    }
+    if (!err) {
+        err = mbedtls_md_hmac_finish(&_md, hmac);
+    }
+    if (err) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    memcpy(mac, hmac, AUTH_MAC_SIZE);
+    return 0;
+}
+
+int AuthenticatedBlockDevice::_verify(uint32_t page, const void *data)
+{
+    uint8_t stored[AUTH_MAC_SIZE];
+    int err = _bd->read(stored, _mac_addr(page), AUTH_MAC_SIZE);
+    if (err) {
+        return err;
+    }
+
+    // An erased MAC is only valid for a page that was never programmed
+    bool blank = true;
+    for (int i = 0; i < AUTH_MAC_SIZE; i++) {
+        if (stored[i] != 0xFF) {
+            blank = false;
+            break;
+        }
+    }
+
+    if (blank) {
+        const uint8_t *p = static_cast<const uint8_t*>(data);
+        for (int i = 0; i < AUTH_PAGE_SIZE; i++) {
+            if (p[i] != 0xFF) {
+                return AUTH_BD_ERROR_MAC_MISMATCH;
+            }
+        }
+        return 0;
+    }
+
+    uint8_t mac[AUTH_MAC_SIZE];
+    err = _compute_mac(page, data, mac);
+    if (err) {
+        return err;
+    }
+
+    // Constant time compare
+    uint8_t diff = 0;
+    for (int i = 0; i < AUTH_MAC_SIZE; i++) {
+        diff |= mac[i] ^ stored[i];
+    }
+
+    return diff ? AUTH_BD_ERROR_MAC_MISMATCH : 0;
+}
+
+const uint8_t *AuthenticatedBlockDevice::_find_verified(uint32_t page) const
+{
+    uint32_t i = page % AUTH_CACHE_ENTRIES;
+    return (_verified[i] == page + 1) ? &_cache[i * AUTH_PAGE_SIZE] : NULL;
+}
+
+void AuthenticatedBlockDevice::_set_verified(uint32_t page, const void *data)
+{
+    uint32_t i = page % AUTH_CACHE_ENTRIES;
+    _verified[i] = page + 1;
+    memcpy(&_cache[i * AUTH_PAGE_SIZE], data, AUTH_PAGE_SIZE);
+}
+
+void AuthenticatedBlockDevice::_clear_verified(uint32_t first, uint32_t count)
+{
+    for (int i = 0; i < AUTH_CACHE_ENTRIES; i++) {
+        if (_verified[i] > first && _verified[i] <= first + count) {
+            _verified[i] = 0;
+        }
+    }
+}
+
+int AuthenticatedBlockDevice::read(void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    // Check the address and size fit onto the chip.
+    MBED_ASSERT(is_valid_read(addr, size));
+
+    while (size > 0) {
+        uint32_t page = addr / AUTH_PAGE_SIZE;
+        uint32_t off = addr % AUTH_PAGE_SIZE;
+        uint32_t chunk = (off + size < AUTH_PAGE_SIZE) ? size : (AUTH_PAGE_SIZE - off);
+        const uint8_t *cached = _find_verified(page);
+        int err = 0;
+
+        if (cached) {
+            // Served from what was verified, the flash may have changed since
+            memcpy(buffer, &cached[off], chunk);
+        } else if (chunk == AUTH_PAGE_SIZE) {
+            // Whole page, verify in place
+            err = _bd->read(buffer, _page_addr(page), AUTH_PAGE_SIZE);
+            if (!err) {
+                err = _verify(page, buffer);
+            }
+            if (!err) {
+                _set_verified(page, buffer);
+            }
+        } else {
+            err = _bd->read(_page, _page_addr(page), AUTH_PAGE_SIZE);
+            if (!err) {
+                err = _verify(page, _page);
+            }
+            if (!err) {
+                memcpy(buffer, &_page[off], chunk);
+                _set_verified(page, _page);
+            }
+        }
+
+        if (err) {
+            return err;
+        }
+
+        buffer = static_cast<uint8_t*>(buffer) + chunk;
+        addr += chunk;
+        size -= chunk;
+    }
+
+    return 0;
+}
+
+int AuthenticatedBlockDevice::program(const void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    // Check the address and size fit onto the chip.
+    MBED_ASSERT(is_valid_program(addr, size));
+
+    while (size > 0) {
+        uint32_t page = addr / AUTH_PAGE_SIZE;
+
+        // Batch the pages up to the end of the erase unit or of the MAC buffer
+        uint32_t count = size / AUTH_PAGE_SIZE;
+        if (count > _data_pages - page % _data_pages) {
+            count = _data_pages - page % _data_pages;
+        }
+        if (count > sizeof(_macs) / AUTH_MAC_SIZE) {
+            count = sizeof(_macs) / AUTH_MAC_SIZE;
+        }
+
+        const uint8_t *data = static_cast<const uint8_t*>(buffer);
+        for (uint32_t i = 0; i < count; i++) {
+            int err = _compute_mac(page + i, &data[i * AUTH_PAGE_SIZE], &_macs[i * AUTH_MAC_SIZE]);
+            if (err) {
+                return err;
+            }
+        }
+
+        // Data first, a torn program then shows up as a missing MAC
+        int err = _bd->program(buffer, _page_addr(page), count * AUTH_PAGE_SIZE);
+        if (err) {
+            return err;
+        }
+
+        err = _bd->program(_macs, _mac_addr(page), count * AUTH_MAC_SIZE);
+        if (err) {
+            return err;
+        }
+
+        // We know what we just wrote, no need to verify it again
+        for (uint32_t i = 0; i < count; i++) {
+            _set_verified(page + i, &data[i * AUTH_PAGE_SIZE]);
+        }
+
+        buffer = static_cast<const uint8_t*>(buffer) + count * AUTH_PAGE_SIZE;
+        addr += count * AUTH_PAGE_SIZE;
+        size -= count * AUTH_PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+int AuthenticatedBlockDevice::erase(bd_addr_t addr, bd_size_t size)
+{
+    // Check the address and size fit onto the chip.
+    MBED_ASSERT(is_valid_erase(addr, size));
+
+    while (size > 0) {
+        uint32_t page = addr / AUTH_PAGE_SIZE;
+
+        // Erasing the unit also clears the MACs in its side area
+        int err = _bd->erase((bd_addr_t)(page / _data_pages) * _unit_size, _unit_size);
+        if (err) {
+            return err;
+        }
+
+        _clear_verified(page, _data_pages);
+
+        addr += _data_pages * AUTH_PAGE_SIZE;
+        size -= _data_pages * AUTH_PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+bd_size_t AuthenticatedBlockDevice::get_read_size() const
+{
+    return _bd->get_read_size();
+}
+
+bd_size_t AuthenticatedBlockDevice::get_program_size() const
+{
+    return AUTH_PAGE_SIZE;
+}
+
+bd_size_t AuthenticatedBlockDevice::get_erase_size() const
+{
+    return _data_pages * AUTH_PAGE_SIZE;
+}
+
+bd_size_t AuthenticatedBlockDevice::size() const
+{
+    return _size;
+}
+
+int AuthenticatedBlockDevice::get_erase_value() const
+{
+    return _bd->get_erase_value();
+}
@@ -0,0 +1,205 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 2018 GreenWaves Technologies
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MBED_AUTHENTICATED_BLOCK_DEVICE_H
+#define MBED_AUTHENTICATED_BLOCK_DEVICE_H
+
+#include <mbed.h>
+#include "BlockDevice.h"
+#include "mbedtls/md.h"
+
+
+// Size of a program page and of the MAC stored for it
+#define AUTH_PAGE_SIZE  512
+#define AUTH_MAC_SIZE   16
+#define AUTH_KEY_SIZE   32
+
+enum {
+    AUTH_BD_ERROR_MAC_MISMATCH = -4101, /*!< page contents do not match their MAC */
+};
+
+/** Block device adding tamper detection to an underlying flash
+ *
+ *  Every 512-byte program page of the underlying device gets a truncated
+ *  HMAC-SHA256 over its address and contents. The MACs of an erase unit
+ *  are kept in a side area at the end of that same unit, so erasing a
+ *  unit clears its MACs along with the data and no separate MAC erase
+ *  is ever needed.
+ *
+ *  |+-+-+-+-+-+-+-+-|
+ *  |  data page 0   |  512
+ *  |      ...       |
+ *  |  data page n   |  512
+ *  |+-+-+-+-+-+-+-+-|
+ *  |  MAC 0 .. n    |  16 * (n + 1), padded to a page
+ *  |+-+-+-+-+-+-+-+-|
+ *
+ *  Pages are verified lazily on read and their verified contents kept in
+ *  a small RAM cache, so repeated reads of the same page cost neither a
+ *  MAC nor a flash access, and changes made to the flash behind the
+ *  driver's back can't skip verification. Programs must cover whole
+ *  pages, and the MACs of all pages programmed by one call are written
+ *  back with a single program of the side area.
+ *
+ *  The side area takes 16 pages of a 256KB unit, so the erase size seen
+ *  through this device is 496 pages, which isn't a power of two. File
+ *  systems that assume power of two erase blocks must be given a block
+ *  size that divides it, such as 16 pages.
+ *
+ *  @code
+ *  HYPERBUSFBlockDevice hyperbusf(...);
+ *  AuthenticatedBlockDevice auth(&hyperbusf, key, sizeof(key));
+ *
+ *  auth.init();
+ *  int err = auth.read(buffer, 0, 512);
+ *  if (err == AUTH_BD_ERROR_MAC_MISMATCH) {
+ *      // page has been tampered with
+ *  }
+ *  @endcode
+ */
+class AuthenticatedBlockDevice : public BlockDevice {
+public:
+    /** Creates an AuthenticatedBlockDevice on top of another block device
+     *
+     *  @param bd       Block device to back the AuthenticatedBlockDevice
+     *  @param key      Secret key of the MACs
+     *  @param key_size Size of the key in bytes, at most AUTH_KEY_SIZE
+     */
+    AuthenticatedBlockDevice(BlockDevice *bd, const void *key, size_t key_size);
+
+    /** Lifetime of the block device
+     */
+    virtual ~AuthenticatedBlockDevice();
+
+    /** Initialize a block device
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int init();
+
+    /** Deinitialize a block device
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int deinit();
+
+    /** Ensure data on storage is in sync with the driver
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int sync();
+
+    /** Read blocks from a block device
+     *
+     *  Pages not in the verified cache are read whole and checked against
+     *  their MAC before any of their data is returned, cached pages are
+     *  served from RAM.
+     *
+     *  @param buffer   Buffer to write blocks to
+     *  @param addr     Address of block to begin reading from
+     *  @param size     Size to read in bytes, must be a multiple of read block size
+     *  @return         0 on success, AUTH_BD_ERROR_MAC_MISMATCH if a page
+     *                  fails verification, negative error code on failure
+     */
+    virtual int read(void *buffer, bd_addr_t addr, bd_size_t size);
+
+    /** Program blocks to a block device
+     *
+     *  The blocks must have been erased prior to being programmed
+     *
+     *  @param buffer   Buffer of data to write to blocks
+     *  @param addr     Address of block to begin writing to
+     *  @param size     Size to write in bytes, must be a multiple of program block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size);
+
+    /** Erase blocks on a block device
+     *
+     *  The state of an erased block is undefined until it has been programmed
+     *
+     *  @param addr     Address of block to begin erasing
+     *  @param size     Size to erase in bytes, must be a multiple of erase block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int erase(bd_addr_t addr, bd_size_t size);
+
+    /** Get the size of a readable block
+     *
+     *  @return         Size of a readable block in bytes
+     */
+    virtual bd_size_t get_read_size() const;
+
+    /** Get the size of a programable block
+     *
+     *  @return         Size of a programable block in bytes
+     *  @note Must be a multiple of the read size
+     */
+    virtual bd_size_t get_program_size() const;
+
+    /** Get the size of a eraseable block
+     *
+     *  @return         Size of a eraseable block in bytes
+     *  @note Must be a multiple of the program size, not a power of two
+     *        as the MACs take part of each underlying erase unit
+     */
+    virtual bd_size_t get_erase_size() const;
+
+    /** Get the value of storage when erased
+     *
+     *  @return         The value of storage when erased
+     */
+    virtual int get_erase_value() const;
+
+    /** Get the total size of the underlying device
+     *
+     *  @return         Size of the underlying device in bytes
+     */
+    virtual bd_size_t size() const;
+
+private:
+    BlockDevice *_bd;
+    uint8_t _key[AUTH_KEY_SIZE];
+    size_t _key_size;
+    mbedtls_md_context_t _md;
+
+    // Geometry of an erase unit
+    bd_size_t _unit_size;
+    uint32_t _unit_pages;
+    uint32_t _data_pages;
+    bd_size_t _size;
+
+    // Direct mapped cache of verified pages, entries hold page index + 1
+    // and the contents that were verified
+    uint32_t _verified[MBED_CONF_HYPERBUSF_DRIVER_AUTH_CACHE_ENTRIES];
+    uint8_t *_cache;
+
+    // Scratch page for partial reads and MACs of one program() batch
+    uint8_t _page[AUTH_PAGE_SIZE];
+    uint8_t _macs[AUTH_PAGE_SIZE];
+
+    // Internal functions
+    bd_addr_t _page_addr(uint32_t page) const;
+    bd_addr_t _mac_addr(uint32_t page) const;
+    int _compute_mac(uint32_t page, const void *data, uint8_t *mac);
+    int _verify(uint32_t page, const void *data);
+    const uint8_t *_find_verified(uint32_t page) const;
+    void _set_verified(uint32_t page, const void *data);
+    void _clear_verified(uint32_t first, uint32_t count);
+};
+
+
+#endif  /* MBED_AUTHENTICATED_BLOCK_DEVICE_H */
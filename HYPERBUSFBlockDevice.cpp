@@ -16,7 +16,7 @@
 
 #include "HYPERBUSFBlockDevice.h"
 
-#define HYPERBUS_SIZE    64*1024*1024
+#define HYPERBUS_SIZE    (64*1024*1024)
 
 /*
 |+-+-+-+-+-+-+-+-|
@@ -39,29 +39,148 @@
 |      ...       |  ...
 |+-+-+-+-+-+-+-+-|
 |                |
+|+-+-+-+-+-+-+-+-|  HYPERBUS_LOG_ADDR, only with log sectors
+|      LOG       |  256K * HYPERBUS_LOG_SECTORS
+|+-+-+-+-+-+-+-+-|  HYPERBUS_REMAP_ADDR, only with spare sectors
+|  REMAP TABLE   |  256K
+|+-+-+-+-+-+-+-+-|
+|  SPARE POOL    |  256K * HYPERBUS_SPARE_SECTORS
+|+-+-+-+-+-+-+-+-|
 */
 
-#define HYPERBUS_FILE_SYSTEM_ADDR_OFFSET  256*1024
+#define HYPERBUS_FILE_SYSTEM_ADDR_OFFSET  (256*1024)
 
 // Read/write/erase sizes
 #define HYPERBUS_READ_SIZE  2
 #define HYPERBUS_PROG_SIZE  2
-#define HYPERBUS_SE_SIZE    256*1024
+#define HYPERBUS_SE_SIZE    (256*1024)
 #define HYPERBUS_TIMEOUT    10000
 
+// Page programs complete well under a millisecond, poll them more often
+#define HYPERBUS_PROGRAM_POLL_US    50
+
 // Status register
 #define HYPERBUS_DEVICE_READY   0x80
+#define HYPERBUS_ERASE_SUSPENDED 0x40
 #define HYPERBUS_ERASE_STATUS   0x20
 #define HYPERBUS_PROGRAM_STATUS 0x10
 
+// Write-back cache and group commit of sync()
+#define HYPERBUS_CACHE_PAGES            MBED_CONF_HYPERBUSF_DRIVER_CACHE_PAGES
+#define HYPERBUS_WRITE_BACK             MBED_CONF_HYPERBUSF_DRIVER_WRITE_BACK
+#define HYPERBUS_GROUP_COMMIT_WINDOW_MS MBED_CONF_HYPERBUSF_DRIVER_GROUP_COMMIT_WINDOW_MS
+#define HYPERBUS_FRAME_NONE             ((bd_addr_t)-1)
+
+// Read caching
+#define HYPERBUS_READ_AHEAD_PAGES       MBED_CONF_HYPERBUSF_DRIVER_READ_AHEAD_PAGES
+#define HYPERBUS_ADVICE_ENTRIES         MBED_CONF_HYPERBUSF_DRIVER_ADVICE_ENTRIES
+#define HYPERBUS_READ_SLICE             MBED_CONF_HYPERBUSF_DRIVER_READ_SLICE_SIZE
+
+// Miss ratio curve sampling, pages hashing below the threshold are sampled
+#define HYPERBUS_MRC_SAMPLES            MBED_CONF_HYPERBUSF_DRIVER_MRC_SAMPLES
+#define HYPERBUS_MRC_MODULUS            (1UL << 24)
+
+// Write amplification accounting
+#define HYPERBUS_PARTITIONS             MBED_CONF_HYPERBUSF_DRIVER_PARTITIONS
+
+// Asynchronous requests
+#define HYPERBUS_QUEUE_DEPTH    MBED_CONF_HYPERBUSF_DRIVER_QUEUE_DEPTH
+#define HYPERBUS_SUBMIT_QUEUES  MBED_CONF_HYPERBUSF_DRIVER_SUBMIT_QUEUES
+#define HYPERBUS_WORKER_STACK   MBED_CONF_HYPERBUSF_DRIVER_WORKER_STACK_SIZE
+
+// Bad sector remapping, addresses are relative to the file system
+#define HYPERBUS_SPARE_SECTORS  MBED_CONF_HYPERBUSF_DRIVER_SPARE_SECTORS
+#define HYPERBUS_REMAP_ADDR     (HYPERBUS_SIZE - HYPERBUS_FILE_SYSTEM_ADDR_OFFSET \
+                                - (HYPERBUS_SPARE_SECTORS + 1) * HYPERBUS_SE_SIZE)
+#define HYPERBUS_REMAP_MAGIC    0x50414d52  // "RMAP"
+
+struct hyperbus_remap_entry {
+    uint32_t magic;
+    uint16_t sector;
+    uint16_t spare;
+};
+
+// Sector telemetry, sectors need a few samples before they can be slow
+#define HYPERBUS_SECTORS                (HYPERBUS_SIZE / HYPERBUS_SE_SIZE)
+#define HYPERBUS_SLOW_SECTOR_PERCENT    MBED_CONF_HYPERBUSF_DRIVER_SLOW_SECTOR_PERCENT
+#define HYPERBUS_SLOW_MIN_ERASES        4
+#define HYPERBUS_SLOW_MIN_PROGRAMS      64
+#define HYPERBUS_BUSY_NONE              -1
+
+// Period the driver thread checks on deferred erases
+#define HYPERBUS_ERASE_POLL_MS          10
+
+// Time a resumed erase runs before it can be suspended again, so that it
+// makes progress under a steady stream of accesses, and the time the
+// device takes to suspend at most
+#define HYPERBUS_ERASE_RUN_US           500
+#define HYPERBUS_SUSPEND_TIMEOUT_US     1000
+
+// Timing profile of the S26KS512S, used until the sectors have been timed
+#define HYPERBUS_T_READ_SETUP_US        2
+#define HYPERBUS_T_READ_BYTES_PER_US    50
+#define HYPERBUS_T_PROGRAM_TYP_US       475
+#define HYPERBUS_T_PROGRAM_MAX_US       2000
+#define HYPERBUS_T_ERASE_TYP_US         930000
+#define HYPERBUS_T_ERASE_MAX_US         3500000
+
+// Persistent log, below the remap table or the end of the device
+#define HYPERBUS_LOG_SECTORS    MBED_CONF_HYPERBUSF_DRIVER_LOG_SECTORS
+#define HYPERBUS_LOG_ADDR       ((HYPERBUS_SPARE_SECTORS ? HYPERBUS_REMAP_ADDR \
+                                : HYPERBUS_SIZE - HYPERBUS_FILE_SYSTEM_ADDR_OFFSET) \
+                                - HYPERBUS_LOG_SECTORS * HYPERBUS_SE_SIZE)
+#define HYPERBUS_LOG_PER_SECTOR (HYPERBUS_SE_SIZE / sizeof(hyperbusf_log_record_t))
+#define HYPERBUS_LOG_SUMMARY_MS (MBED_CONF_HYPERBUSF_DRIVER_LOG_SUMMARY_PERIOD_S * 1000ULL)
+#define HYPERBUS_LOG_RECORDS    ((HYPERBUS_LOG_SECTORS ? HYPERBUS_LOG_SECTORS : 1) * HYPERBUS_LOG_PER_SECTOR)
+
+
+HYPERBUSFBlockDevice::queue::queue() :
+    slots(HYPERBUS_QUEUE_DEPTH, HYPERBUS_QUEUE_DEPTH),
+    free(NULL), head(NULL), tail(NULL)
+{
+    for (int i = 0; i < HYPERBUS_QUEUE_DEPTH; i++) {
+        requests[i].next = free;
+        free = &requests[i];
+    }
+}
 
 HYPERBUSFBlockDevice::HYPERBUSFBlockDevice(PinName dq0, PinName dq1, PinName dq2, PinName dq3,
                                          PinName dq4, PinName dq5, PinName dq6, PinName dq7,
                                          PinName ck, PinName ckn, PinName rwds, PinName ssel0,
                                          PinName ssel1) :
     _hyperbus(dq0, dq1, dq2, dq3, dq4, dq5, dq6, dq7, ck, ckn, rwds, ssel0, ssel1),
-    _size(HYPERBUS_SIZE)
+    _size(HYPERBUS_LOG_SECTORS ? HYPERBUS_LOG_ADDR :
+          HYPERBUS_SPARE_SECTORS ? HYPERBUS_REMAP_ADDR : HYPERBUS_SIZE),
+    _remap(NULL), _remap_entries(0), _spares_used(0),
+    _stamp(0), _pinned(0), _advice_count(0), _read_next(HYPERBUS_FRAME_NONE),
+    _mrc_count(0), _mrc_threshold(HYPERBUS_MRC_MODULUS), _mrc_clock(0),
+    _mrc_refs(0), _mrc_cold(0),
+    _commit_cond(_mutex), _commit_open(1), _commit_done(0),
+    _commit_err(0), _committing(false), _polls(0), _status(0),
+    _telemetry(NULL), _erase_mean(0), _erase_count(0), _program_mean(0), _program_count(0),
+    _busy_op(HYPERBUS_BUSY_NONE), _busy_sector(0), _busy_start(0),
+    _erase_next(0), _erase_end(0), _erase_err(0),
+    _suspended(false), _suspend_time(0), _resume_time(0), _suspended_sector(0), _suspended_start(0),
+    _log_head(0), _log_seq(0), _log_ready(false), _summary_next(0), _partition_count(0),
+    _queue_ready(0), _queue_next(0),
+    _worker(osPriorityAboveNormal, HYPERBUS_WORKER_STACK, NULL, "hyperbusf"),
+    _worker_started(false), _accepting(false), _pending(0), _drained(_mutex)
 {
+    for (int i = 0; i < HYPERBUS_CACHE_PAGES; i++) {
+        _frames[i].addr = HYPERBUS_FRAME_NONE;
+        _frames[i].lo = HYPERBUS_PAGE_SIZE;
+        _frames[i].hi = 0;
+        _frames[i].refs = 0;
+        _frames[i].stamp = 0;
+        _frames[i].valid = false;
+        _frames[i].cold = false;
+        _frames[i].pinned = false;
+    }
+    memset(&_stats, 0, sizeof(_stats));
+    memset(_mrc_hist, 0, sizeof(_mrc_hist));
+    memset(_thresholds, 0, sizeof(_thresholds));
+    _timer.start();
+
     int latency = 0;
 
     /* Config memory maximum transfer data length for TX and RX*/
@@ -81,122 +200,2124 @@ int HYPERBUSFBlockDevice::init()
     _hyperbus.write(0x555 << 1, 0x38, uHYPERBUS_Mem_Access);
     _hyperbus.write(0     << 1, 0x8e0b, uHYPERBUS_Mem_Access);
 
+    // Telemetry outlives deinit(), sectors keep aging
+    if (!_telemetry) {
+        _telemetry = new (std::nothrow) sector_telemetry[HYPERBUS_SECTORS];
+        if (!_telemetry) {
+            return BD_ERROR_DEVICE_ERROR;
+        }
+        memset(_telemetry, 0, HYPERBUS_SECTORS * sizeof(sector_telemetry));
+    }
+
+    if (HYPERBUS_SPARE_SECTORS) {
+        int err = _remap_init();
+        if (err) {
+            return err;
+        }
+    }
+
+    if (HYPERBUS_LOG_SECTORS) {
+        int err = _log_init();
+        if (err) {
+            return err;
+        }
+    }
+
+    _summary_next = Kernel::get_ms_count() + HYPERBUS_LOG_SUMMARY_MS;
+
+    // The driver thread outlives deinit(), threads can't be restarted
+    if (!_worker_started) {
+        if (_worker.start(callback(this, &HYPERBUSFBlockDevice::_dispatch)) != osOK) {
+            return BD_ERROR_DEVICE_ERROR;
+        }
+        _worker_started = true;
+    }
+
+    _mutex.lock();
+    _accepting = true;
+    _mutex.unlock();
+
     return 0;
 }
 
 int HYPERBUSFBlockDevice::deinit()
 {
+    _mutex.lock();
+    _accepting = false;
+    while (_pending) {
+        _drained.wait();
+    }
+
+    _settle();
+    int err = _erase_err;
+    _erase_err = 0;
+    if (!err) {
+        err = _cache_flush();
+    }
+    if (!err) {
+        err = _log_summary();
+    }
+    _log_ready = false;
+    _mutex.unlock();
+    if (err) {
+        return err;
+    }
+
+    delete[] _remap;
+    _remap = NULL;
+
     return 0;
 }
 
-int HYPERBUSFBlockDevice::_sync()
+int HYPERBUSFBlockDevice::_sync(int poll_us)
 {
-    for (int i = 0; i < HYPERBUS_TIMEOUT; i++) {
+    // Keep the overall timeout independent of the polling period
+    int polls = HYPERBUS_TIMEOUT * (1000 / poll_us);
+
+    for (int i = 0; i < polls; i++) {
         /* Read status register */
         _hyperbus.write(0x555 << 1, 0x70, uHYPERBUS_Mem_Access);
 
         uint16_t status = _hyperbus.read(0, uHYPERBUS_Mem_Access);
+        _polls += 1;
+        _status = status;
 
         // Check Device Ready bit
         if (status & HYPERBUS_DEVICE_READY) {
-            return 0;
+            _telemetry_done();
+
+            if (!(status & (HYPERBUS_ERASE_STATUS | HYPERBUS_PROGRAM_STATUS))) {
+                return 0;
+            }
+
+            /* Clear status register, the failure stays latched otherwise */
+            _hyperbus.write(0x555 << 1, 0x71, uHYPERBUS_Mem_Access);
+
+            return (status & HYPERBUS_ERASE_STATUS) ? HYPERBUSF_ERROR_ERASE_FAILED
+                                                    : HYPERBUSF_ERROR_PROGRAM_FAILED;
         }
 
-        wait_ms(1);
+        wait_us(poll_us);
     }
 
+    _busy_op = HYPERBUS_BUSY_NONE;
     return BD_ERROR_DEVICE_ERROR;
 }
 
+static uint32_t running_mean(uint32_t mean, uint32_t count, uint32_t sample)
+{
+    return mean + ((int64_t)sample - mean) / (int64_t)count;
+}
+
+void HYPERBUSFBlockDevice::_telemetry_done()
+{
+    if (_busy_op == HYPERBUS_BUSY_NONE) {
+        return;
+    }
+
+    uint32_t duration = _timer.read_high_resolution_us() - _busy_start;
+    sector_telemetry *t = (_telemetry && _busy_sector < HYPERBUS_SECTORS) ? &_telemetry[_busy_sector] : NULL;
+
+    if (_busy_op == HYPERBUSF_OP_ERASE) {
+        _erase_count += 1;
+        _erase_mean = running_mean(_erase_mean, _erase_count, duration);
+        if (t) {
+            if (t->erases < 0xFFFF) {
+                t->erases += 1;
+            }
+            t->erase_mean = running_mean(t->erase_mean, t->erases, duration);
+            if (duration > t->erase_max) {
+                t->erase_max = duration;
+            }
+        }
+    } else {
+        _program_count += 1;
+        _program_mean = running_mean(_program_mean, _program_count, duration);
+        if (t) {
+            if (t->programs < 0xFFFF) {
+                t->programs += 1;
+            }
+            t->program_mean = running_mean(t->program_mean, t->programs, duration);
+            if (duration > t->program_max) {
+                t->program_max = duration;
+            }
+        }
+    }
+
+    _busy_op = HYPERBUS_BUSY_NONE;
+}
+
+bool HYPERBUSFBlockDevice::_slow(const sector_telemetry *t) const
+{
+    return (t->erases >= HYPERBUS_SLOW_MIN_ERASES &&
+            (uint64_t)t->erase_mean * 100 > (uint64_t)_erase_mean * HYPERBUS_SLOW_SECTOR_PERCENT) ||
+           (t->programs >= HYPERBUS_SLOW_MIN_PROGRAMS &&
+            (uint64_t)t->program_mean * 100 > (uint64_t)_program_mean * HYPERBUS_SLOW_SECTOR_PERCENT);
+}
+
+void HYPERBUSFBlockDevice::_estimate_page(bd_addr_t addr, uint64_t *expected, uint64_t *worst)
+{
+    uint32_t sector = _phys(addr) / HYPERBUS_SE_SIZE;
+    const sector_telemetry *t = (_telemetry && sector < HYPERBUS_SECTORS) ? &_telemetry[sector] : NULL;
+
+    *expected += (t && t->programs) ? t->program_mean :
+                 _program_count ? _program_mean : HYPERBUS_T_PROGRAM_TYP_US;
+    *worst += (t && t->program_max > HYPERBUS_T_PROGRAM_MAX_US) ? t->program_max : HYPERBUS_T_PROGRAM_MAX_US;
+}
+
+void HYPERBUSFBlockDevice::estimate(hyperbusf_op_t op, bd_addr_t addr, bd_size_t size,
+                                    hyperbusf_estimate_t *estimate)
+{
+    MBED_ASSERT(op < HYPERBUSF_OP_COUNT);
+    MBED_ASSERT(op == HYPERBUSF_OP_SYNC || addr + size <= _size);
+
+    _mutex.lock();
+
+    uint64_t expected = 0;
+    uint64_t worst = 0;
+
+    if (op == HYPERBUSF_OP_READ) {
+        // One transfer per sector, remapping may split them
+        uint32_t sectors = (addr + size + HYPERBUS_SE_SIZE - 1) / HYPERBUS_SE_SIZE - addr / HYPERBUS_SE_SIZE;
+        expected = sectors * HYPERBUS_T_READ_SETUP_US + size / HYPERBUS_T_READ_BYTES_PER_US;
+        worst = 2 * expected;
+    } else if (op == HYPERBUSF_OP_PROGRAM) {
+        // One program per page touched
+        while (size > 0) {
+            uint32_t off = addr % HYPERBUS_PAGE_SIZE;
+            uint32_t chunk = (off + size < HYPERBUS_PAGE_SIZE) ? size : (HYPERBUS_PAGE_SIZE - off);
+
+            _estimate_page(addr, &expected, &worst);
+
+            addr += chunk;
+            size -= chunk;
+        }
+    } else if (op == HYPERBUSF_OP_ERASE) {
+        for (bd_addr_t a = addr - addr % HYPERBUS_SE_SIZE; a < addr + size; a += HYPERBUS_SE_SIZE) {
+            uint32_t sector = _phys(a) / HYPERBUS_SE_SIZE;
+            const sector_telemetry *t = (_telemetry && sector < HYPERBUS_SECTORS) ? &_telemetry[sector] : NULL;
+
+            expected += (t && t->erases) ? t->erase_mean :
+                        _erase_count ? _erase_mean : HYPERBUS_T_ERASE_TYP_US;
+            worst += (t && t->erase_max > HYPERBUS_T_ERASE_MAX_US) ? t->erase_max : HYPERBUS_T_ERASE_MAX_US;
+        }
+    } else {
+        for (int i = 0; i < HYPERBUS_CACHE_PAGES; i++) {
+            if (_frames[i].hi > _frames[i].lo) {
+                _estimate_page(_frames[i].addr, &expected, &worst);
+            }
+        }
+    }
+
+    _mutex.unlock();
+
+    estimate->expected_us = (expected > 0xFFFFFFFF) ? 0xFFFFFFFF : expected;
+    estimate->worst_us = (worst > 0xFFFFFFFF) ? 0xFFFFFFFF : worst;
+}
+
+void HYPERBUSFBlockDevice::get_sector_stats(bd_addr_t addr, hyperbusf_sector_stats_t *stats)
+{
+    MBED_ASSERT(addr < _size);
+
+    _mutex.lock();
+
+    memset(stats, 0, sizeof(*stats));
+
+    uint32_t sector = _phys(addr) / HYPERBUS_SE_SIZE;
+    if (_telemetry && sector < HYPERBUS_SECTORS) {
+        const sector_telemetry *t = &_telemetry[sector];
+        stats->erases = t->erases;
+        stats->erase_mean_us = t->erase_mean;
+        stats->erase_max_us = t->erase_max;
+        stats->programs = t->programs;
+        stats->program_mean_us = t->program_mean;
+        stats->program_max_us = t->program_max;
+        stats->slow = _slow(t);
+    }
+
+    _mutex.unlock();
+}
+
+bool HYPERBUSFBlockDevice::is_slow_sector(bd_addr_t addr)
+{
+    MBED_ASSERT(addr < _size);
+
+    _mutex.lock();
+
+    uint32_t sector = _phys(addr) / HYPERBUS_SE_SIZE;
+    bool slow = _telemetry && sector < HYPERBUS_SECTORS && _slow(&_telemetry[sector]);
+
+    _mutex.unlock();
+    return slow;
+}
+
 int HYPERBUSFBlockDevice::_wren()
 {
     return 0;
 }
 
-int HYPERBUSFBlockDevice::read(void *buffer, bd_addr_t addr, bd_size_t size)
+bool HYPERBUSFBlockDevice::_ready()
 {
-    // Check the address and size fit onto the chip.
-    MBED_ASSERT(is_valid_read(addr, size));
+    /* Read status register */
+    _hyperbus.write(0x555 << 1, 0x70, uHYPERBUS_Mem_Access);
 
-    _hyperbus.read_block(addr + HYPERBUS_FILE_SYSTEM_ADDR_OFFSET, (char*)buffer, size, uHYPERBUS_Mem_Access);
+    uint16_t status = _hyperbus.read(0, uHYPERBUS_Mem_Access);
+    _polls += 1;
+    _status = status;
 
-    return 0;
+    return status & HYPERBUS_DEVICE_READY;
 }
 
-int HYPERBUSFBlockDevice::program(const void *buffer, bd_addr_t addr, bd_size_t size)
+void HYPERBUSFBlockDevice::_settle(bool wait)
 {
-    // Check the address and size fit onto the chip.
-    MBED_ASSERT(is_valid_program(addr, size));
+    while (_erase_next < _erase_end) {
+        if (!_erase_step(wait)) {
+            return;
+        }
+    }
+}
 
-    while (size > 0) {
-        int err = _wren();
-        if (err) {
-            return err;
+bool HYPERBUSFBlockDevice::_erase_step(bool wait)
+{
+    _resume();
+
+    if (!wait && !_ready()) {
+        return false;
+    }
+
+    // Whatever runs from here on sees the device idle
+    bd_addr_t addr = _erase_next;
+    _erase_next = _erase_end;
+
+    int err = _sync();
+    while (!err && (_status & HYPERBUS_ERASE_SUSPENDED)) {
+        // A suspend that was given up on took effect late
+        _hyperbus.write(_phys(addr) + HYPERBUS_FILE_SYSTEM_ADDR_OFFSET, 0x30, uHYPERBUS_Mem_Access);
+        err = _sync();
+    }
+    if (err == HYPERBUSF_ERROR_ERASE_FAILED) {
+        // Spares are erased when taken, nothing to move
+        err = _remap_sector(addr / HYPERBUS_SE_SIZE, 0, HYPERBUS_SE_SIZE, err);
+    }
+    if (err && !_erase_err) {
+        _erase_err = err;
+    }
+
+    addr += HYPERBUS_SE_SIZE;
+    if (addr < _erase_end) {
+        _erase_sector(_phys(addr));
+        _erase_next = addr;
+        _resume_time = _busy_start;
+    }
+
+    return true;
+}
+
+bool HYPERBUSFBlockDevice::_erasing(bd_addr_t addr, bd_size_t size)
+{
+    if (_erase_next >= _erase_end) {
+        return false;
+    }
+
+    bd_addr_t busy = _phys(_erase_next);
+    return addr < busy + HYPERBUS_SE_SIZE && addr + size > busy;
+}
+
+void HYPERBUSFBlockDevice::_access(bd_addr_t addr, bd_size_t size)
+{
+    // The sector being erased can only be used once its erase is over,
+    // the following sectors of the range are suspended in turn
+    while (_erase_next < _erase_end) {
+        bool erasing = _erasing(addr, size);
+        if (_suspended && !erasing) {
+            return;
         }
 
-        // Write up to 256*2 bytes a page
-        // TODO handle unaligned programs
-        uint32_t off = addr % 512;
-        uint32_t chunk = (off + size < 512) ? size : (512-off);
+        if (erasing || !_suspend()) {
+            _erase_step(true);
+        }
+    }
+}
 
-        /* Command Sequence */
-        _hyperbus.write(0x555 << 1, 0xAA, uHYPERBUS_Mem_Access);
-        _hyperbus.write(0x2AA << 1, 0x55, uHYPERBUS_Mem_Access);
-        _hyperbus.write(0x555 << 1, 0xA0, uHYPERBUS_Mem_Access);
+bool HYPERBUSFBlockDevice::_suspend()
+{
+    bd_addr_t busy = _phys(_erase_next);
+    uint64_t now = _timer.read_high_resolution_us();
+    if (now - _resume_time < HYPERBUS_ERASE_RUN_US) {
+        wait_us(HYPERBUS_ERASE_RUN_US - (now - _resume_time));
+    }
 
-        /* Word Program */
-        _hyperbus.write_block(addr + HYPERBUS_FILE_SYSTEM_ADDR_OFFSET, (char *)buffer, chunk, uHYPERBUS_Mem_Access);
+    /* Erase Suspend */
+    _hyperbus.write(busy + HYPERBUS_FILE_SYSTEM_ADDR_OFFSET, 0xB0, uHYPERBUS_Mem_Access);
 
-        buffer = static_cast<const uint8_t*>(buffer) + chunk;
-        addr += chunk;
-        size -= chunk;
+    for (int i = 0; i < HYPERBUS_SUSPEND_TIMEOUT_US / HYPERBUS_PROGRAM_POLL_US; i++) {
+        if (_ready()) {
+            // The erase may have ended before it could be suspended
+            if (!(_status & HYPERBUS_ERASE_SUSPENDED)) {
+                break;
+            }
 
-        err = _sync();
-        if (err) {
-            return err;
+            _suspended = true;
+            _suspend_time = _timer.read_high_resolution_us();
+            _suspended_sector = _busy_sector;
+            _suspended_start = _busy_start;
+            _busy_op = HYPERBUS_BUSY_NONE;
+            return true;
+        }
+
+        wait_us(HYPERBUS_PROGRAM_POLL_US);
+    }
+
+    return false;
+}
+
+void HYPERBUSFBlockDevice::_resume()
+{
+    if (!_suspended) {
+        return;
+    }
+
+    /* Erase Resume */
+    _hyperbus.write(_phys(_erase_next) + HYPERBUS_FILE_SYSTEM_ADDR_OFFSET, 0x30, uHYPERBUS_Mem_Access);
+
+    // Time spent suspended doesn't count towards the erase
+    _resume_time = _timer.read_high_resolution_us();
+    _busy_op = HYPERBUSF_OP_ERASE;
+    _busy_sector = _suspended_sector;
+    _busy_start = _suspended_start + (_resume_time - _suspend_time);
+    _suspended = false;
+}
+
+void HYPERBUSFBlockDevice::_program_page(bd_addr_t addr, const void *buffer, bd_size_t size)
+{
+    _access(addr, size);
+    MBED_ASSERT(_erase_next >= _erase_end || (_suspended && !_erasing(addr, size)));
+
+    /* Command Sequence */
+    _hyperbus.write(0x555 << 1, 0xAA, uHYPERBUS_Mem_Access);
+    _hyperbus.write(0x2AA << 1, 0x55, uHYPERBUS_Mem_Access);
+    _hyperbus.write(0x555 << 1, 0xA0, uHYPERBUS_Mem_Access);
+
+    /* Word Program */
+    _hyperbus.write_block(addr + HYPERBUS_FILE_SYSTEM_ADDR_OFFSET, (const char *)buffer, size, uHYPERBUS_Mem_Access);
+
+    _busy_op = HYPERBUSF_OP_PROGRAM;
+    _busy_sector = addr / HYPERBUS_SE_SIZE;
+    _busy_start = _timer.read_high_resolution_us();
+
+    _account(&hyperbusf_wa_t::programmed_bytes, _logical(addr), size);
+}
+
+void HYPERBUSFBlockDevice::_erase_sector(bd_addr_t addr)
+{
+    _settle();
+
+    /* Erase sector */
+    _hyperbus.write(0x555 << 1, 0xAA, uHYPERBUS_Mem_Access);
+    _hyperbus.write(0x2AA << 1, 0x55, uHYPERBUS_Mem_Access);
+    _hyperbus.write(0x555 << 1, 0x80, uHYPERBUS_Mem_Access);
+    _hyperbus.write(0x555 << 1, 0xAA, uHYPERBUS_Mem_Access);
+    _hyperbus.write(0x2AA << 1, 0x55, uHYPERBUS_Mem_Access);
+
+    _hyperbus.write(addr + HYPERBUS_FILE_SYSTEM_ADDR_OFFSET, 0x30, uHYPERBUS_Mem_Access);
+
+    _busy_op = HYPERBUSF_OP_ERASE;
+    _busy_sector = addr / HYPERBUS_SE_SIZE;
+    _busy_start = _timer.read_high_resolution_us();
+
+    _account(&hyperbusf_wa_t::erased_bytes, _logical(addr), HYPERBUS_SE_SIZE);
+}
+
+bd_addr_t HYPERBUSFBlockDevice::_phys(bd_addr_t addr) const
+{
+    if (!_remap) {
+        return addr;
+    }
+
+    return (bd_addr_t)_remap[addr / HYPERBUS_SE_SIZE] * HYPERBUS_SE_SIZE + addr % HYPERBUS_SE_SIZE;
+}
+
+bd_addr_t HYPERBUSFBlockDevice::_logical(bd_addr_t addr) const
+{
+    if (!_remap || addr < HYPERBUS_REMAP_ADDR) {
+        return addr;
+    }
+
+    // Only spares in use stand for a logical sector
+    uint32_t sectors = _size / HYPERBUS_SE_SIZE;
+    for (uint32_t i = 0; i < sectors; i++) {
+        if (_remap[i] == addr / HYPERBUS_SE_SIZE) {
+            return (bd_addr_t)i * HYPERBUS_SE_SIZE + addr % HYPERBUS_SE_SIZE;
+        }
+    }
+
+    return HYPERBUS_FRAME_NONE;
+}
+
+void HYPERBUSFBlockDevice::_account(uint64_t hyperbusf_wa_t::*counter, bd_addr_t addr, bd_size_t size)
+{
+    _stats.wa.*counter += size;
+
+    if (addr == HYPERBUS_FRAME_NONE) {
+        return;
+    }
+
+    for (int i = 0; i < _partition_count; i++) {
+        partition *p = &_partitions[i];
+        bd_addr_t lo = (addr > p->addr) ? addr : p->addr;
+        bd_addr_t hi = (addr + size < p->addr + p->size) ? addr + size : p->addr + p->size;
+        if (hi > lo) {
+            p->wa.*counter += hi - lo;
+        }
+    }
+}
+
+// Spare indexes are checked as signed, the pool is empty by default
+static bool is_spare(int spare)
+{
+    return spare < HYPERBUS_SPARE_SECTORS;
+}
+
+int HYPERBUSFBlockDevice::_remap_init()
+{
+    uint32_t sectors = _size / HYPERBUS_SE_SIZE;
+
+    delete[] _remap;
+    _remap = new (std::nothrow) uint16_t[sectors];
+    if (!_remap) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    for (uint32_t i = 0; i < sectors; i++) {
+        _remap[i] = i;
+    }
+    _remap_entries = 0;
+    _spares_used = 0;
+
+    // Replay the table, later entries override earlier ones
+    struct hyperbus_remap_entry entries[HYPERBUS_PAGE_SIZE / sizeof(struct hyperbus_remap_entry)];
+    const uint32_t count = sizeof(entries) / sizeof(entries[0]);
+    uint32_t valid = 0;
+
+    while (_remap_entries < HYPERBUS_SE_SIZE / sizeof(entries[0])) {
+        uint32_t i = _remap_entries % count;
+        if (i == 0) {
+            _hyperbus.read_block(HYPERBUS_REMAP_ADDR + _remap_entries * sizeof(entries[0])
+                    + HYPERBUS_FILE_SYSTEM_ADDR_OFFSET, (char*)entries, sizeof(entries), uHYPERBUS_Mem_Access);
+        }
+
+        if (entries[i].magic == 0xFFFFFFFF && entries[i].sector == 0xFFFF &&
+                entries[i].spare == 0xFFFF) {
+            break;
+        }
+
+        // A torn entry still takes its slot, appends go after it
+        _remap_entries++;
+        if (entries[i].magic != HYPERBUS_REMAP_MAGIC ||
+                entries[i].sector >= sectors || !is_spare(entries[i].spare)) {
+            continue;
+        }
+
+        _remap[entries[i].sector] = (HYPERBUS_REMAP_ADDR / HYPERBUS_SE_SIZE) + 1 + entries[i].spare;
+        if (entries[i].spare >= _spares_used) {
+            _spares_used = entries[i].spare + 1;
         }
+        valid++;
     }
 
+    // A table that is neither valid nor blank was left over from another
+    // layout, start over with an empty one
+    if (_remap_entries > 0 && valid == 0) {
+        _remap_entries = 0;
+        _erase_sector(HYPERBUS_REMAP_ADDR);
+        return _sync();
+    }
 
     return 0;
 }
 
-int HYPERBUSFBlockDevice::erase(bd_addr_t addr, bd_size_t size)
+int HYPERBUSFBlockDevice::_remap_sector(uint32_t sector, bd_addr_t skip, bd_size_t skip_size, int err)
 {
-    // Check the address and size fit onto the chip.
-    MBED_ASSERT(is_valid_erase(addr, size));
+    if (!_remap) {
+        return err;
+    }
 
-    while (size > 0) {
-        int err = _wren();
-        if (err) {
-            return err;
+    bd_addr_t old = (bd_addr_t)_remap[sector] * HYPERBUS_SE_SIZE;
+
+    while (is_spare(_spares_used) &&
+            _remap_entries < HYPERBUS_SE_SIZE / sizeof(struct hyperbus_remap_entry)) {
+        uint16_t spare = _spares_used++;
+        bd_addr_t addr = HYPERBUS_REMAP_ADDR + (1 + spare) * HYPERBUS_SE_SIZE;
+
+        // Spares may hold anything from before they were reserved
+        _erase_sector(addr);
+        int spare_err = _sync();
+        if (spare_err == HYPERBUSF_ERROR_ERASE_FAILED) {
+            continue;
+        } else if (spare_err) {
+            return spare_err;
         }
 
-        // Erase 256kbyte sectors
-        // TODO support other erase sizes?
-        uint32_t chunk = HYPERBUS_SE_SIZE;
+        // Move everything around the range that failed
+        spare_err = _copy(old, addr, skip);
+        if (!spare_err) {
+            spare_err = _copy(old + skip + skip_size, addr + skip + skip_size,
+                    HYPERBUS_SE_SIZE - skip - skip_size);
+        }
+        if (spare_err == HYPERBUSF_ERROR_PROGRAM_FAILED) {
+            continue;
+        } else if (spare_err) {
+            return spare_err;
+        }
+
+        // The table entry is the commit point of the move
+        struct hyperbus_remap_entry entry = { HYPERBUS_REMAP_MAGIC, (uint16_t)sector, spare };
+        _program_page(HYPERBUS_REMAP_ADDR + _remap_entries * sizeof(entry), &entry, sizeof(entry));
+        spare_err = _sync(HYPERBUS_PROGRAM_POLL_US);
+        if (spare_err) {
+            return spare_err;
+        }
+
+        _remap_entries++;
+        _remap[sector] = (HYPERBUS_REMAP_ADDR / HYPERBUS_SE_SIZE) + 1 + spare;
+        return 0;
+    }
+
+    return err;
+}
+
+int HYPERBUSFBlockDevice::_read(void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    // Whoever suspended the erase resumes it
+    bool suspended = _suspended;
 
-        /* Erase sector */
-        _hyperbus.write(0x555 << 1, 0xAA, uHYPERBUS_Mem_Access);
-        _hyperbus.write(0x2AA << 1, 0x55, uHYPERBUS_Mem_Access);
-        _hyperbus.write(0x555 << 1, 0x80, uHYPERBUS_Mem_Access);
-        _hyperbus.write(0x555 << 1, 0xAA, uHYPERBUS_Mem_Access);
-        _hyperbus.write(0x2AA << 1, 0x55, uHYPERBUS_Mem_Access);
+    while (size > 0) {
+        // Sectors may be remapped, don't read across them
+        bd_size_t chunk = HYPERBUS_SE_SIZE - addr % HYPERBUS_SE_SIZE;
+        if (chunk > size) {
+            chunk = size;
+        }
 
-        _hyperbus.write(addr + HYPERBUS_FILE_SYSTEM_ADDR_OFFSET, 0x30, uHYPERBUS_Mem_Access);
+        _access(_phys(addr), chunk);
+        MBED_ASSERT(_erase_next >= _erase_end || (_suspended && !_erasing(_phys(addr), chunk)));
+        _hyperbus.read_block(_phys(addr) + HYPERBUS_FILE_SYSTEM_ADDR_OFFSET, (char*)buffer, chunk, uHYPERBUS_Mem_Access);
 
+        buffer = static_cast<uint8_t*>(buffer) + chunk;
         addr += chunk;
         size -= chunk;
+    }
 
-        err = _sync();
-        if (err) {
-            return err;
-        }
+    if (!suspended) {
+        _resume();
     }
 
     return 0;
 }
 
+int HYPERBUSFBlockDevice::_program(const void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    // Whoever suspended the erase resumes it
+    bool suspended = _suspended;
+    int err = 0;
+
+    while (size > 0) {
+        err = _wren();
+        if (err) {
+            break;
+        }
+
+        // Write up to 256*2 bytes a page
+        // TODO handle unaligned programs
+        uint32_t off = addr % HYPERBUS_PAGE_SIZE;
+        uint32_t chunk = (off + size < HYPERBUS_PAGE_SIZE) ? size : (HYPERBUS_PAGE_SIZE - off);
+
+        _program_page(_phys(addr), buffer, chunk);
+
+        err = _sync(HYPERBUS_PROGRAM_POLL_US);
+        if (err == HYPERBUSF_ERROR_PROGRAM_FAILED) {
+            // Retry the same chunk once the sector moved to a spare
+            err = _remap_sector(addr / HYPERBUS_SE_SIZE, addr % HYPERBUS_SE_SIZE, chunk, err);
+            if (!err) {
+                continue;
+            }
+        }
+        if (err) {
+            break;
+        }
+
+        buffer = static_cast<const uint8_t*>(buffer) + chunk;
+        addr += chunk;
+        size -= chunk;
+    }
+
+    if (!suspended) {
+        _resume();
+    }
+
+    return err;
+}
+
+int HYPERBUSFBlockDevice::_erase(bd_addr_t addr, bd_size_t size)
+{
+    while (size > 0) {
+        int err = _wren();
+        if (err) {
+            return err;
+        }
+
+        // Erase 256kbyte sectors
+        // TODO support other erase sizes?
+        uint32_t chunk = HYPERBUS_SE_SIZE;
+
+        _erase_sector(_phys(addr));
+
+        err = _sync();
+        if (err == HYPERBUSF_ERROR_ERASE_FAILED) {
+            // Spares are erased when taken, nothing to move
+            err = _remap_sector(addr / HYPERBUS_SE_SIZE, 0, HYPERBUS_SE_SIZE, err);
+        }
+        if (err) {
+            return err;
+        }
+
+        addr += chunk;
+        size -= chunk;
+    }
+
+    return 0;
+}
+
+HYPERBUSFBlockDevice::frame *HYPERBUSFBlockDevice::_frame_find(bd_addr_t page)
+{
+    for (int i = 0; i < HYPERBUS_CACHE_PAGES; i++) {
+        if (_frames[i].addr == page) {
+            return &_frames[i];
+        }
+    }
+
+    return NULL;
+}
+
+int HYPERBUSFBlockDevice::_frame_get(bd_addr_t page, frame **f)
+{
+    *f = _frame_find(page);
+    if (*f) {
+        return 0;
+    }
+
+    // Take a free frame, or write back the least recently used one, pages
+    // read once go first and pinned or borrowed pages never do
+    frame *victim = NULL;
+    for (int i = 0; i < HYPERBUS_CACHE_PAGES; i++) {
+        frame *c = &_frames[i];
+        if (c->refs || c->pinned) {
+            continue;
+        }
+
+        if (c->addr == HYPERBUS_FRAME_NONE) {
+            victim = c;
+            break;
+        }
+
+        if (!victim || (c->cold && !victim->cold) ||
+                (c->cold == victim->cold && (int32_t)(c->stamp - victim->stamp) < 0)) {
+            victim = c;
+        }
+    }
+
+    if (!victim) {
+        return HYPERBUSF_ERROR_NO_FRAME;
+    }
+
+    int err = _frame_flush(victim);
+    if (err) {
+        return err;
+    }
+
+    _frame_release(victim);
+    victim->addr = page;
+    memset(victim->data, 0xFF, HYPERBUS_PAGE_SIZE);
+
+    *f = victim;
+    return 0;
+}
+
+int HYPERBUSFBlockDevice::_frame_flush(frame *f)
+{
+    if (f->hi <= f->lo) {
+        return 0;
+    }
+
+    int err = _program(&f->data[f->lo], f->addr + f->lo, f->hi - f->lo);
+    if (err) {
+        return err;
+    }
+
+    _stats.pages_flushed += 1;
+
+    // A valid page already matches what is now on the device
+    f->lo = HYPERBUS_PAGE_SIZE;
+    f->hi = 0;
+    if (!f->valid) {
+        memset(f->data, 0xFF, HYPERBUS_PAGE_SIZE);
+    }
+
+    return 0;
+}
+
+int HYPERBUSFBlockDevice::_frame_fill(bd_addr_t page, hyperbusf_advice_t advice, frame **f)
+{
+    int err = _frame_get(page, f);
+    if (err) {
+        return err;
+    }
+
+    // The frame may be evicted through _copy_buffer, only read it now
+    err = _read(_copy_buffer[0], page, HYPERBUS_PAGE_SIZE);
+    if (err) {
+        return err;
+    }
+
+    // Programs still pending read back as if they were written
+    for (int i = 0; i < HYPERBUS_PAGE_SIZE; i++) {
+        (*f)->data[i] &= _copy_buffer[0][i];
+    }
+
+    (*f)->valid = true;
+    _frame_touch(*f, advice);
+
+    return 0;
+}
+
+void HYPERBUSFBlockDevice::_frame_touch(frame *f, hyperbusf_advice_t advice)
+{
+    f->stamp = ++_stamp;
+    f->cold = (advice == HYPERBUSF_ADVICE_SEQUENTIAL);
+
+    // Keep a frame to cycle the other pages through
+    bool pin = (advice == HYPERBUSF_ADVICE_PIN) &&
+            (f->pinned || _pinned < HYPERBUS_CACHE_PAGES - 1);
+    if (pin != f->pinned) {
+        _pinned += pin ? 1 : -1;
+        f->pinned = pin;
+    }
+}
+
+void HYPERBUSFBlockDevice::_frame_release(frame *f)
+{
+    if (f->pinned) {
+        _pinned -= 1;
+    }
+
+    // Borrowers keep the data they were given until they release it
+    f->addr = HYPERBUS_FRAME_NONE;
+    f->lo = HYPERBUS_PAGE_SIZE;
+    f->hi = 0;
+    f->valid = (f->refs > 0);
+    f->cold = false;
+    f->pinned = false;
+}
+
+hyperbusf_advice_t HYPERBUSFBlockDevice::_advised(bd_addr_t addr) const
+{
+    for (int i = _advice_count - 1; i >= 0; i--) {
+        if (addr >= _advice[i].addr && addr < _advice[i].addr + _advice[i].size) {
+            return _advice[i].advice;
+        }
+    }
+
+    return HYPERBUSF_ADVICE_NORMAL;
+}
+
+int HYPERBUSFBlockDevice::_cache_flush()
+{
+    for (int i = 0; i < HYPERBUS_CACHE_PAGES; i++) {
+        int err = _frame_flush(&_frames[i]);
+        if (err) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+int HYPERBUSFBlockDevice::_cache_program(const void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    while (size > 0) {
+        uint32_t off = addr % HYPERBUS_PAGE_SIZE;
+        uint32_t chunk = (off + size < HYPERBUS_PAGE_SIZE) ? size : (HYPERBUS_PAGE_SIZE - off);
+
+        frame *f;
+        int err = _frame_get(addr - off, &f);
+        if (err == HYPERBUSF_ERROR_NO_FRAME) {
+            // With every frame held the program goes straight through
+            err = _program(buffer, addr, chunk);
+            if (err) {
+                return err;
+            }
+
+            buffer = static_cast<const uint8_t*>(buffer) + chunk;
+            addr += chunk;
+            size -= chunk;
+            continue;
+        } else if (err) {
+            return err;
+        }
+
+        // Programming only clears bits, so repeated programs of a page
+        // coalesce into the AND of everything written to it
+        const uint8_t *data = static_cast<const uint8_t*>(buffer);
+        for (uint32_t i = 0; i < chunk; i++) {
+            f->data[off + i] &= data[i];
+        }
+
+        if (off < f->lo) {
+            f->lo = off;
+        }
+        if (off + chunk > f->hi) {
+            f->hi = off + chunk;
+        }
+        f->stamp = ++_stamp;
+
+        buffer = static_cast<const uint8_t*>(buffer) + chunk;
+        addr += chunk;
+        size -= chunk;
+    }
+
+    return 0;
+}
+
+void HYPERBUSFBlockDevice::_cache_merge(void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    for (int i = 0; i < HYPERBUS_CACHE_PAGES; i++) {
+        frame *f = &_frames[i];
+        if (f->hi <= f->lo) {
+            continue;
+        }
+
+        bd_addr_t lo = f->addr + f->lo;
+        bd_addr_t hi = f->addr + f->hi;
+        if (lo < addr) {
+            lo = addr;
+        }
+        if (hi > addr + size) {
+            hi = addr + size;
+        }
+
+        // Data still in the cache reads back as if it was programmed
+        uint8_t *data = static_cast<uint8_t*>(buffer);
+        for (bd_addr_t a = lo; a < hi; a++) {
+            data[a - addr] &= f->data[a - f->addr];
+        }
+    }
+}
+
+void HYPERBUSFBlockDevice::_cache_drop(bd_addr_t addr, bd_size_t size)
+{
+    for (int i = 0; i < HYPERBUS_CACHE_PAGES; i++) {
+        if (_frames[i].addr != HYPERBUS_FRAME_NONE &&
+                _frames[i].addr + HYPERBUS_PAGE_SIZE > addr && _frames[i].addr < addr + size) {
+            _frame_release(&_frames[i]);
+        }
+    }
+}
+
+void HYPERBUSFBlockDevice::_cache_update(const void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    while (size > 0) {
+        uint32_t off = addr % HYPERBUS_PAGE_SIZE;
+        uint32_t chunk = (off + size < HYPERBUS_PAGE_SIZE) ? size : (HYPERBUS_PAGE_SIZE - off);
+
+        // Written through, keep cached copies in step with the device
+        frame *f = _frame_find(addr - off);
+        if (f && f->valid) {
+            const uint8_t *data = static_cast<const uint8_t*>(buffer);
+            for (uint32_t i = 0; i < chunk; i++) {
+                f->data[off + i] &= data[i];
+            }
+        }
+
+        buffer = static_cast<const uint8_t*>(buffer) + chunk;
+        addr += chunk;
+        size -= chunk;
+    }
+}
+
+static uint32_t mrc_hash(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x85ebca6b;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35;
+    x ^= x >> 16;
+    return x % HYPERBUS_MRC_MODULUS;
+}
+
+void HYPERBUSFBlockDevice::_mrc_scale(uint32_t threshold)
+{
+    // Counts taken at the old rate stand for fewer references at the new one
+    for (int i = 0; i <= HYPERBUSF_MRC_POINTS; i++) {
+        _mrc_hist[i] = (uint64_t)_mrc_hist[i] * threshold / _mrc_threshold;
+    }
+    _mrc_cold = (uint64_t)_mrc_cold * threshold / _mrc_threshold;
+    _mrc_refs = (uint64_t)_mrc_refs * threshold / _mrc_threshold;
+    _mrc_threshold = threshold;
+}
+
+void HYPERBUSFBlockDevice::_mrc_access(uint32_t page)
+{
+    uint32_t hash = mrc_hash(page);
+    if (hash >= _mrc_threshold) {
+        return;
+    }
+
+    _mrc_clock += 1;
+
+    mrc_sample *s = NULL;
+    for (int i = 0; i < _mrc_count; i++) {
+        if (_mrc_samples[i].page == page) {
+            s = &_mrc_samples[i];
+            break;
+        }
+    }
+
+    if (s) {
+        // Distinct sampled pages touched since, scaled up by the rate
+        uint32_t distance = 0;
+        for (int i = 0; i < _mrc_count; i++) {
+            if ((int32_t)(_mrc_samples[i].last - s->last) > 0) {
+                distance += 1;
+            }
+        }
+        distance = (uint64_t)distance * HYPERBUS_MRC_MODULUS / _mrc_threshold;
+
+        // A cache of 1 << i pages hits when the distance is below its size
+        int point = 0;
+        while (point < HYPERBUSF_MRC_POINTS && distance >= (1UL << point)) {
+            point += 1;
+        }
+
+        _mrc_hist[point] += 1;
+        _mrc_refs += 1;
+        s->last = _mrc_clock;
+        return;
+    }
+
+    if (_mrc_count == HYPERBUS_MRC_SAMPLES) {
+        // Full, the page hashing highest leaves and takes the rate down
+        // with it
+        mrc_sample *top = &_mrc_samples[0];
+        for (int i = 1; i < _mrc_count; i++) {
+            if (_mrc_samples[i].hash > top->hash) {
+                top = &_mrc_samples[i];
+            }
+        }
+
+        if (hash > top->hash) {
+            _mrc_scale(hash);
+            return;
+        }
+
+        _mrc_scale(top->hash);
+        *top = _mrc_samples[--_mrc_count];
+    }
+
+    _mrc_samples[_mrc_count].page = page;
+    _mrc_samples[_mrc_count].hash = hash;
+    _mrc_samples[_mrc_count].last = _mrc_clock;
+    _mrc_count += 1;
+
+    _mrc_cold += 1;
+    _mrc_refs += 1;
+}
+
+void HYPERBUSFBlockDevice::get_miss_ratio_curve(hyperbusf_mrc_t *mrc)
+{
+    _mutex.lock();
+
+    memset(mrc, 0, sizeof(*mrc));
+    mrc->references = _mrc_refs;
+
+    if (_mrc_refs) {
+        // Everything further than a cache holds misses, as do first touches
+        uint32_t misses = _mrc_cold;
+        for (int i = HYPERBUSF_MRC_POINTS - 1; i >= 0; i--) {
+            misses += _mrc_hist[i + 1];
+            mrc->miss_permille[i] = (uint64_t)misses * 1000 / _mrc_refs;
+        }
+    }
+
+    _mutex.unlock();
+}
+
+int HYPERBUSFBlockDevice::_cache_read(void *buffer, bd_addr_t addr, bd_size_t size, bool fits, bool streaming, bool last)
+{
+    if (HYPERBUS_MRC_SAMPLES && size > 0) {
+        for (bd_addr_t page = addr / HYPERBUS_PAGE_SIZE;
+                page <= (addr + size - 1) / HYPERBUS_PAGE_SIZE; page++) {
+            _mrc_access(page);
+        }
+    }
+
+    // Pages that aren't admitted are read straight into the buffer, in
+    // runs as long as possible
+    uint8_t *run = static_cast<uint8_t*>(buffer);
+    bd_addr_t run_addr = addr;
+    bd_addr_t page = HYPERBUS_FRAME_NONE;
+    hyperbusf_advice_t advice = HYPERBUSF_ADVICE_NORMAL;
+
+    while (size > 0) {
+        uint32_t off = addr % HYPERBUS_PAGE_SIZE;
+        uint32_t chunk = (off + size < HYPERBUS_PAGE_SIZE) ? size : (HYPERBUS_PAGE_SIZE - off);
+        uint8_t *data = static_cast<uint8_t*>(buffer);
+
+        page = addr - off;
+        advice = _advised(page);
+
+        frame *f = _frame_find(page);
+        if (f && f->valid) {
+            _frame_touch(f, advice);
+            _stats.read_hits += 1;
+        } else if (advice != HYPERBUSF_ADVICE_DONTNEED &&
+                (fits || advice == HYPERBUSF_ADVICE_PIN)) {
+            // With every frame held the page is read around the cache
+            int err = _frame_fill(page, advice, &f);
+            if (err == HYPERBUSF_ERROR_NO_FRAME) {
+                f = NULL;
+            } else if (err) {
+                return err;
+            } else {
+                _stats.read_misses += 1;
+            }
+        } else {
+            f = NULL;
+        }
+
+        if (f) {
+            if (data > run) {
+                int err = _read(run, run_addr, data - run);
+                if (err) {
+                    return err;
+                }
+                _cache_merge(run, run_addr, data - run);
+            }
+
+            memcpy(data, &f->data[off], chunk);
+            run = data + chunk;
+            run_addr = addr + chunk;
+        }
+
+        buffer = data + chunk;
+        addr += chunk;
+        size -= chunk;
+    }
+
+    uint8_t *end = static_cast<uint8_t*>(buffer);
+    if (end > run) {
+        int err = _read(run, run_addr, end - run);
+        if (err) {
+            return err;
+        }
+        _cache_merge(run, run_addr, end - run);
+    }
+
+    // Read ahead is best effort, errors are left to whoever reads the page
+    if (last && page != HYPERBUS_FRAME_NONE && (advice == HYPERBUSF_ADVICE_SEQUENTIAL ||
+            (advice == HYPERBUSF_ADVICE_NORMAL && streaming))) {
+        for (int i = 1; i <= HYPERBUS_READ_AHEAD_PAGES; i++) {
+            bd_addr_t next = page + i * HYPERBUS_PAGE_SIZE;
+            if (next >= _size) {
+                break;
+            }
+
+            frame *f = _frame_find(next);
+            if (f && f->valid) {
+                continue;
+            }
+
+            hyperbusf_advice_t next_advice = _advised(next);
+            if (next_advice == HYPERBUSF_ADVICE_DONTNEED ||
+                    _frame_fill(next, next_advice, &f)) {
+                break;
+            }
+            _stats.pages_prefetched += 1;
+        }
+    }
+
+    return 0;
+}
+
+int HYPERBUSFBlockDevice::_read_sliced(void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    // Admission and read-ahead are decided on the whole read, so slices
+    // of a read larger than the cache don't flush it either. Reads
+    // picking up where the last one stopped are streamed as well.
+    bool fits = (size <= HYPERBUS_CACHE_PAGES * HYPERBUS_PAGE_SIZE);
+    bool streaming = (addr == _read_next);
+    _read_next = addr + size;
+
+    while (true) {
+        // Without slicing the whole read is a single slice
+        bd_size_t chunk = size;
+        bd_size_t slice = HYPERBUS_READ_SLICE;
+        if (slice && chunk > slice - addr % slice) {
+            chunk = slice - addr % slice;
+        }
+
+        // Only the last slice reads ahead
+        int err = _cache_read(buffer, addr, chunk, fits, streaming, chunk == size);
+        size -= chunk;
+        if (err || size == 0) {
+            return err;
+        }
+
+        buffer = static_cast<uint8_t*>(buffer) + chunk;
+        addr += chunk;
+
+        // Threads waiting on the mutex take the device in between slices,
+        // one of higher priority right away
+        _mutex.unlock();
+        _mutex.lock();
+    }
+}
+
+int HYPERBUSFBlockDevice::read(void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    // Check the address and size fit onto the chip.
+    MBED_ASSERT(is_valid_read(addr, size));
+
+    _mutex.lock();
+    uint64_t start = _timer.read_high_resolution_us();
+    uint32_t polls = _polls;
+
+    int err = _read_sliced(buffer, addr, size);
+
+    _watch(HYPERBUSF_OP_READ, addr, size, start, polls);
+    _mutex.unlock();
+
+    return err;
+}
+
+int HYPERBUSFBlockDevice::program(const void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    // Check the address and size fit onto the chip.
+    MBED_ASSERT(is_valid_program(addr, size));
+
+    _mutex.lock();
+    uint64_t start = _timer.read_high_resolution_us();
+    uint32_t polls = _polls;
+
+    _account(&hyperbusf_wa_t::logical_bytes, addr, size);
+
+    int err;
+    if (HYPERBUS_WRITE_BACK) {
+        err = _cache_program(buffer, addr, size);
+    } else {
+        err = _program(buffer, addr, size);
+        if (!err) {
+            _cache_update(buffer, addr, size);
+        } else {
+            _cache_drop(addr, size);
+        }
+    }
+
+    _watch(HYPERBUSF_OP_PROGRAM, addr, size, start, polls);
+    _mutex.unlock();
+    return err;
+}
+
+int HYPERBUSFBlockDevice::erase(bd_addr_t addr, bd_size_t size)
+{
+    // Check the address and size fit onto the chip.
+    MBED_ASSERT(is_valid_erase(addr, size));
+
+    _mutex.lock();
+    uint64_t start = _timer.read_high_resolution_us();
+    uint32_t polls = _polls;
+
+    // Whatever was still waiting to be written is erased anyway
+    _cache_drop(addr, size);
+    int err = _erase(addr, size);
+
+    _watch(HYPERBUSF_OP_ERASE, addr, size, start, polls);
+    _mutex.unlock();
+    return err;
+}
+
+int HYPERBUSFBlockDevice::erase_deferred(bd_addr_t addr, bd_size_t size)
+{
+    // Check the address and size fit onto the chip.
+    MBED_ASSERT(is_valid_erase(addr, size));
+
+    if (size == 0) {
+        return 0;
+    }
+
+    _mutex.lock();
+    uint64_t start = _timer.read_high_resolution_us();
+    uint32_t polls = _polls;
+
+    // Whatever was still waiting to be written is erased anyway
+    _cache_drop(addr, size);
+
+    _erase_sector(_phys(addr));
+    _erase_next = addr;
+    _erase_end = addr + size;
+
+    _watch(HYPERBUSF_OP_ERASE, addr, size, start, polls);
+    _mutex.unlock();
+
+    // Get the driver thread polling for the end of the erase
+    if (_worker_started) {
+        _queue_ready.release();
+    }
+
+    return 0;
+}
+
+int HYPERBUSFBlockDevice::sync()
+{
+    _mutex.lock();
+    _stats.syncs += 1;
+    uint64_t start = _timer.read_high_resolution_us();
+    uint32_t polls = _polls;
+
+    // Everything programmed before this call belongs to the open batch,
+    // the first caller leads it and later ones just wait for it
+    uint32_t batch = _commit_open;
+    int err = 0;
+
+    while ((int32_t)(_commit_done - batch) < 0) {
+        if (_committing) {
+            _commit_cond.wait();
+            continue;
+        }
+
+        // Nothing left to write, an earlier batch already covered us
+        if (!_dirty()) {
+            break;
+        }
+
+        _committing = true;
+
+        // Give concurrent callers a chance to join before closing the batch
+        if (HYPERBUS_GROUP_COMMIT_WINDOW_MS) {
+            _commit_cond.wait_for(HYPERBUS_GROUP_COMMIT_WINDOW_MS);
+        }
+
+        uint32_t closed = _commit_open++;
+        _commit_err = _cache_flush();
+        _commit_done = closed;
+        _stats.flushes += 1;
+
+        _committing = false;
+        _commit_cond.notify_all();
+    }
+
+    if ((int32_t)(_commit_done - batch) >= 0) {
+        err = _commit_err;
+    }
+
+    // Deferred erases are durable by now too
+    _settle();
+    if (!err) {
+        err = _erase_err;
+    }
+    _erase_err = 0;
+
+    _watch(HYPERBUSF_OP_SYNC, 0, 0, start, polls);
+    _mutex.unlock();
+    return err;
+}
+
+bool HYPERBUSFBlockDevice::_dirty() const
+{
+    for (int i = 0; i < HYPERBUS_CACHE_PAGES; i++) {
+        if (_frames[i].hi > _frames[i].lo) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int HYPERBUSFBlockDevice::advise(bd_addr_t addr, bd_size_t size, hyperbusf_advice_t advice)
+{
+    // Check the address and size fit onto the chip.
+    MBED_ASSERT(is_valid_read(addr, size));
+
+    _mutex.lock();
+
+    bd_addr_t first = addr - addr % HYPERBUS_PAGE_SIZE;
+    int err = 0;
+
+    if (advice == HYPERBUSF_ADVICE_WILLNEED) {
+        // Stop before the range evicts its own pages
+        int room = HYPERBUS_CACHE_PAGES - _pinned;
+        for (bd_addr_t page = first; page < addr + size && room > 0; page += HYPERBUS_PAGE_SIZE) {
+            frame *f = _frame_find(page);
+            if (!f || !f->valid) {
+                err = _frame_fill(page, _advised(page), &f);
+                if (err) {
+                    break;
+                }
+                _stats.pages_prefetched += 1;
+            }
+            room -= 1;
+        }
+
+        // Loading less than asked for is fine
+        if (err == HYPERBUSF_ERROR_NO_FRAME) {
+            err = 0;
+        }
+
+        _mutex.unlock();
+        return err;
+    }
+
+    if (advice == HYPERBUSF_ADVICE_PIN) {
+        int pages = (addr + size - first + HYPERBUS_PAGE_SIZE - 1) / HYPERBUS_PAGE_SIZE;
+        for (int i = 0; i < HYPERBUS_CACHE_PAGES; i++) {
+            if (_frames[i].pinned && _frames[i].addr >= first && _frames[i].addr < addr + size) {
+                pages -= 1;
+            }
+        }
+
+        if (_pinned + pages > HYPERBUS_CACHE_PAGES - 1) {
+            _mutex.unlock();
+            return HYPERBUSF_ERROR_ADVICE;
+        }
+    }
+
+    // Advice hidden by this one is forgotten, normal advice is only
+    // needed to override what is left
+    int count = 0;
+    bool overlaps = false;
+    for (int i = 0; i < _advice_count; i++) {
+        if (_advice[i].addr >= addr && _advice[i].addr + _advice[i].size <= addr + size) {
+            continue;
+        }
+
+        count += 1;
+        if (_advice[i].addr < addr + size && _advice[i].addr + _advice[i].size > addr) {
+            overlaps = true;
+        }
+    }
+
+    bool keep = (advice != HYPERBUSF_ADVICE_NORMAL || overlaps);
+    if (keep && count == HYPERBUS_ADVICE_ENTRIES) {
+        _mutex.unlock();
+        return HYPERBUSF_ERROR_ADVICE;
+    }
+
+    count = 0;
+    for (int i = 0; i < _advice_count; i++) {
+        if (!(_advice[i].addr >= addr && _advice[i].addr + _advice[i].size <= addr + size)) {
+            _advice[count++] = _advice[i];
+        }
+    }
+
+    if (keep) {
+        _advice[count].addr = addr;
+        _advice[count].size = size;
+        _advice[count].advice = advice;
+        count += 1;
+    }
+    _advice_count = count;
+
+    // Apply the advice to what is already cached
+    for (int i = 0; i < HYPERBUS_CACHE_PAGES && !err; i++) {
+        frame *f = &_frames[i];
+        if (f->addr == HYPERBUS_FRAME_NONE || f->addr < first || f->addr >= addr + size) {
+            continue;
+        }
+
+        if (advice == HYPERBUSF_ADVICE_DONTNEED) {
+            err = _frame_flush(f);
+            if (!err) {
+                _frame_release(f);
+            }
+        } else {
+            _frame_touch(f, advice);
+        }
+    }
+
+    if (advice == HYPERBUSF_ADVICE_PIN) {
+        for (bd_addr_t page = first; page < addr + size && !err; page += HYPERBUS_PAGE_SIZE) {
+            frame *f = _frame_find(page);
+            if (!f || !f->valid) {
+                err = _frame_fill(page, advice, &f);
+                _stats.pages_prefetched += 1;
+            }
+        }
+    }
+
+    _mutex.unlock();
+    return err;
+}
+
+int HYPERBUSFBlockDevice::borrow(bd_addr_t addr, bd_size_t size, const void **data)
+{
+    // Check the address and size fit onto the chip.
+    MBED_ASSERT(is_valid_read(addr, size));
+    MBED_ASSERT(addr % HYPERBUS_PAGE_SIZE + size <= HYPERBUS_PAGE_SIZE);
+
+    _mutex.lock();
+
+    bd_addr_t page = addr - addr % HYPERBUS_PAGE_SIZE;
+    hyperbusf_advice_t advice = _advised(page);
+    int err = 0;
+
+    frame *f = _frame_find(page);
+    if (f && f->valid) {
+        _frame_touch(f, advice);
+        _stats.read_hits += 1;
+    } else {
+        err = _frame_fill(page, advice, &f);
+        if (!err) {
+            _stats.read_misses += 1;
+        }
+    }
+
+    if (!err) {
+        f->refs += 1;
+        *data = &f->data[addr % HYPERBUS_PAGE_SIZE];
+    }
+
+    _mutex.unlock();
+    return err;
+}
+
+void HYPERBUSFBlockDevice::release(const void *data)
+{
+    const uint8_t *p = static_cast<const uint8_t*>(data);
+
+    _mutex.lock();
+
+    frame *f = NULL;
+    for (int i = 0; i < HYPERBUS_CACHE_PAGES; i++) {
+        if (p >= _frames[i].data && p < _frames[i].data + HYPERBUS_PAGE_SIZE) {
+            f = &_frames[i];
+            break;
+        }
+    }
+
+    MBED_ASSERT(f && f->refs > 0);
+    f->refs -= 1;
+
+    // Frames dropped while borrowed are free once the last view goes
+    if (!f->refs && f->addr == HYPERBUS_FRAME_NONE) {
+        f->valid = false;
+    }
+
+    _mutex.unlock();
+}
+
+static void wa_ratio(hyperbusf_wa_t *wa)
+{
+    wa->wa_permille = wa->logical_bytes ? wa->programmed_bytes * 1000 / wa->logical_bytes : 0;
+}
+
+void HYPERBUSFBlockDevice::get_stats(hyperbusf_stats_t *stats)
+{
+    _mutex.lock();
+    *stats = _stats;
+    _mutex.unlock();
+
+    wa_ratio(&stats->wa);
+}
+
+int HYPERBUSFBlockDevice::add_partition(bd_addr_t addr, bd_size_t size)
+{
+    MBED_ASSERT(addr + size <= _size);
+
+    _mutex.lock();
+
+    if (_partition_count == HYPERBUS_PARTITIONS) {
+        _mutex.unlock();
+        return HYPERBUSF_ERROR_NO_PARTITION;
+    }
+
+    int p = _partition_count++;
+    _partitions[p].addr = addr;
+    _partitions[p].size = size;
+    memset(&_partitions[p].wa, 0, sizeof(_partitions[p].wa));
+
+    _mutex.unlock();
+    return p;
+}
+
+int HYPERBUSFBlockDevice::get_partition_stats(int partition, hyperbusf_wa_t *wa)
+{
+    _mutex.lock();
+
+    if (partition < 0 || partition >= _partition_count) {
+        _mutex.unlock();
+        return HYPERBUSF_ERROR_NO_PARTITION;
+    }
+
+    *wa = _partitions[partition].wa;
+    _mutex.unlock();
+
+    wa_ratio(wa);
+    return 0;
+}
+
+int HYPERBUSFBlockDevice::_cache_flush_range(bd_addr_t addr, bd_size_t size)
+{
+    for (int i = 0; i < HYPERBUS_CACHE_PAGES; i++) {
+        frame *f = &_frames[i];
+        if (f->addr != HYPERBUS_FRAME_NONE &&
+                f->addr + HYPERBUS_PAGE_SIZE > addr && f->addr < addr + size) {
+            int err = _frame_flush(f);
+            if (err) {
+                return err;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int HYPERBUSFBlockDevice::_submit(int op, void *buffer, bd_addr_t addr, bd_size_t size,
+                                  int flags, Callback<void(int)> func)
+{
+    _mutex.lock();
+    if (!_accepting) {
+        _mutex.unlock();
+        return BD_ERROR_DEVICE_ERROR;
+    }
+    _pending += 1;
+    _mutex.unlock();
+
+    // Spread the threads over the queues, a thread always uses the same one
+    uintptr_t id = (uintptr_t)ThisThread::get_id();
+    queue *q = &_queues[(id >> 3) % HYPERBUS_SUBMIT_QUEUES];
+
+    q->slots.wait();
+
+    q->lock.lock();
+    request *r = q->free;
+    q->free = r->next;
+
+    r->next = NULL;
+    r->op = op;
+    r->flags = flags;
+    r->buffer = buffer;
+    r->addr = addr;
+    r->size = size;
+    r->callback = func;
+
+    if (q->tail) {
+        q->tail->next = r;
+    } else {
+        q->head = r;
+    }
+    q->tail = r;
+    q->lock.unlock();
+
+    _queue_ready.release();
+    return 0;
+}
+
+int HYPERBUSFBlockDevice::read_async(void *buffer, bd_addr_t addr, bd_size_t size,
+                                     Callback<void(int)> func)
+{
+    // Check the address and size fit onto the chip.
+    MBED_ASSERT(is_valid_read(addr, size));
+
+    return _submit(HYPERBUSF_OP_READ, buffer, addr, size, 0, func);
+}
+
+int HYPERBUSFBlockDevice::program_async(const void *buffer, bd_addr_t addr, bd_size_t size,
+                                        int flags, Callback<void(int)> func)
+{
+    // Check the address and size fit onto the chip.
+    MBED_ASSERT(is_valid_program(addr, size));
+
+    return _submit(HYPERBUSF_OP_PROGRAM, const_cast<void*>(buffer), addr, size, flags, func);
+}
+
+int HYPERBUSFBlockDevice::_execute(request *r)
+{
+    _mutex.lock();
+    uint64_t start = _timer.read_high_resolution_us();
+    uint32_t polls = _polls;
+
+    int err = 0;
+    if (r->op == HYPERBUSF_OP_READ) {
+        err = _read_sliced(r->buffer, r->addr, r->size);
+
+        _watch(HYPERBUSF_OP_READ, r->addr, r->size, start, polls);
+        _mutex.unlock();
+        return err;
+    }
+
+    _account(&hyperbusf_wa_t::logical_bytes, r->addr, r->size);
+
+    if (r->flags & HYPERBUSF_WRITE_BARRIER) {
+        err = _cache_flush();
+    }
+
+    if (!err && (r->flags & HYPERBUSF_WRITE_DIRECT)) {
+        // Cached data of the range goes first so the device sees the
+        // writes in order, the stale copies are dropped after
+        err = _cache_flush_range(r->addr, r->size);
+        if (!err) {
+            _cache_drop(r->addr, r->size);
+            err = _program(r->buffer, r->addr, r->size);
+        }
+    } else if (!err) {
+        if (HYPERBUS_WRITE_BACK) {
+            err = _cache_program(r->buffer, r->addr, r->size);
+        } else {
+            err = _program(r->buffer, r->addr, r->size);
+            if (!err) {
+                _cache_update(r->buffer, r->addr, r->size);
+            } else {
+                _cache_drop(r->addr, r->size);
+            }
+        }
+    }
+
+    if (!err && (r->flags & HYPERBUSF_WRITE_FUA)) {
+        err = _cache_flush_range(r->addr, r->size);
+    }
+
+    _watch(HYPERBUSF_OP_PROGRAM, r->addr, r->size, start, polls);
+    _mutex.unlock();
+    return err;
+}
+
+void HYPERBUSFBlockDevice::_dispatch()
+{
+    while (true) {
+        // Summaries are due whether or not requests keep coming
+        uint32_t timeout = osWaitForever;
+        if (HYPERBUS_LOG_SECTORS && HYPERBUS_LOG_SUMMARY_MS != 0) {
+            uint64_t now = Kernel::get_ms_count();
+            if (now >= _summary_next) {
+                _mutex.lock();
+                _log_summary();
+                _mutex.unlock();
+                _summary_next = now + HYPERBUS_LOG_SUMMARY_MS;
+            }
+            timeout = _summary_next - now;
+        }
+
+        // Keep deferred erases going while nothing else needs the device
+        if (_erase_next < _erase_end && timeout > HYPERBUS_ERASE_POLL_MS) {
+            timeout = HYPERBUS_ERASE_POLL_MS;
+        }
+
+        if (!_queue_ready.wait(timeout)) {
+            _mutex.lock();
+            _settle(false);
+            _mutex.unlock();
+            continue;
+        }
+
+        // Serve the submission queues round-robin, one request at a time
+        queue *q = NULL;
+        request *r = NULL;
+        for (int i = 0; i < HYPERBUS_SUBMIT_QUEUES && !r; i++) {
+            q = &_queues[_queue_next];
+            _queue_next = (_queue_next + 1) % HYPERBUS_SUBMIT_QUEUES;
+
+            q->lock.lock();
+            r = q->head;
+            if (r) {
+                q->head = r->next;
+                if (!q->head) {
+                    q->tail = NULL;
+                }
+            }
+            q->lock.unlock();
+        }
+
+        // Woken without a request to start polling a deferred erase
+        if (!r) {
+            continue;
+        }
+
+        int err = _execute(r);
+        Callback<void(int)> func = r->callback;
+
+        q->lock.lock();
+        r->next = q->free;
+        q->free = r;
+        q->lock.unlock();
+        q->slots.release();
+
+        if (func) {
+            func(err);
+        }
+
+        _mutex.lock();
+        _pending -= 1;
+        if (!_pending) {
+            _drained.notify_all();
+        }
+        _mutex.unlock();
+    }
+}
+
+static bool is_blank(const uint8_t *buffer, bd_size_t size)
+{
+    for (bd_size_t i = 0; i < size; i++) {
+        if (buffer[i] != 0xFF) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int HYPERBUSFBlockDevice::copy(bd_addr_t src, bd_addr_t dst, bd_size_t size)
+{
+    // Check the address and size fit onto the chip.
+    MBED_ASSERT(is_valid_read(src, size));
+    MBED_ASSERT(is_valid_program(dst, size));
+    MBED_ASSERT(src + size <= dst || dst + size <= src);
+
+    _mutex.lock();
+    uint64_t start = _timer.read_high_resolution_us();
+    uint32_t polls = _polls;
+    bd_addr_t addr = dst;
+    bd_size_t total = size;
+    bool suspended = _suspended;
+
+    // The copy works on the flash array, bring both ranges up to date
+    // first and forget what the destination held. Pages the destination
+    // only partly covers keep the rest of their writes this way.
+    int err = _cache_flush_range(src, size);
+    if (!err) {
+        err = _cache_flush_range(dst, size);
+    }
+    if (!err) {
+        _cache_drop(dst, size);
+    }
+
+    while (!err && size > 0) {
+        // Sectors may be remapped, don't copy across them
+        bd_size_t chunk = HYPERBUS_SE_SIZE - src % HYPERBUS_SE_SIZE;
+        if (chunk > HYPERBUS_SE_SIZE - dst % HYPERBUS_SE_SIZE) {
+            chunk = HYPERBUS_SE_SIZE - dst % HYPERBUS_SE_SIZE;
+        }
+        if (chunk > size) {
+            chunk = size;
+        }
+
+        err = _copy(_phys(src), _phys(dst), chunk);
+        if (err == HYPERBUSF_ERROR_PROGRAM_FAILED) {
+            // Retry the whole chunk once the destination moved to a spare,
+            // the source follows if it shares the sector
+            err = _remap_sector(dst / HYPERBUS_SE_SIZE, dst % HYPERBUS_SE_SIZE, chunk, err);
+            if (!err) {
+                continue;
+            }
+        }
+        if (err) {
+            break;
+        }
+
+        src += chunk;
+        dst += chunk;
+        size -= chunk;
+    }
+
+    if (!suspended) {
+        _resume();
+    }
+
+    _watch(HYPERBUSF_OP_PROGRAM, addr, total, start, polls);
+    _mutex.unlock();
+    return err;
+}
+
+int HYPERBUSFBlockDevice::_copy(bd_addr_t src, bd_addr_t dst, bd_size_t size)
+{
+    if (size == 0) {
+        return 0;
+    }
+
+    // Clearing one side may start the erase of a sector on the other
+    do {
+        _access(src, size);
+        _access(dst, size);
+    } while (_erasing(src, size));
+
+    // Chunks follow the destination pages so each one is a single program
+    uint32_t chunk = HYPERBUS_PAGE_SIZE - dst % HYPERBUS_PAGE_SIZE;
+    if (chunk > size) {
+        chunk = size;
+    }
+
+    int cur = 0;
+    _hyperbus.read_block(src + HYPERBUS_FILE_SYSTEM_ADDR_OFFSET, (char*)_copy_buffer[cur], chunk, uHYPERBUS_Mem_Access);
+    bool blank = is_blank(_copy_buffer[cur], chunk);
+
+    while (size > 0) {
+        uint32_t next = (size - chunk < HYPERBUS_PAGE_SIZE) ? size - chunk : HYPERBUS_PAGE_SIZE;
+
+        // The array can't be read while programming, so fetch the next
+        // chunk into the other buffer before starting this one
+        if (next) {
+            _hyperbus.read_block(src + chunk + HYPERBUS_FILE_SYSTEM_ADDR_OFFSET,
+                    (char*)_copy_buffer[cur ^ 1], next, uHYPERBUS_Mem_Access);
+        }
+
+        // Erased chunks are already what the destination holds
+        if (!blank) {
+            int err = _wren();
+            if (err) {
+                return err;
+            }
+
+            _program_page(dst, _copy_buffer[cur], chunk);
+        }
+
+        // Check the next chunk while the device is busy programming
+        bool next_blank = is_blank(_copy_buffer[cur ^ 1], next);
+
+        if (!blank) {
+            int err = _sync(HYPERBUS_PROGRAM_POLL_US);
+            if (err) {
+                return err;
+            }
+        }
+
+        src += chunk;
+        dst += chunk;
+        size -= chunk;
+        chunk = next;
+        blank = next_blank;
+        cur ^= 1;
+    }
+
+    return 0;
+}
+
+void HYPERBUSFBlockDevice::set_latency_threshold(hyperbusf_op_t op, uint32_t us)
+{
+    MBED_ASSERT(op < HYPERBUSF_OP_COUNT);
+
+    _mutex.lock();
+    _thresholds[op] = us;
+    _mutex.unlock();
+}
+
+int HYPERBUSFBlockDevice::_queue_depth()
+{
+    int depth = 0;
+    for (int i = 0; i < HYPERBUS_SUBMIT_QUEUES; i++) {
+        _queues[i].lock.lock();
+        for (request *r = _queues[i].head; r; r = r->next) {
+            depth += 1;
+        }
+        _queues[i].lock.unlock();
+    }
+
+    return depth;
+}
+
+void HYPERBUSFBlockDevice::_watch(hyperbusf_op_t op, bd_addr_t addr, bd_size_t size,
+                                  uint64_t start, uint32_t polls)
+{
+    uint32_t duration = _timer.read_high_resolution_us() - start;
+
+    int bucket = 0;
+    for (uint32_t limit = 8; bucket < HYPERBUSF_LATENCY_BUCKETS - 1 && duration >= limit; limit <<= 3) {
+        bucket += 1;
+    }
+    _stats.latency[op][bucket] += 1;
+
+    if (!_thresholds[op] || duration <= _thresholds[op]) {
+        return;
+    }
+
+    _stats.slow_ops += 1;
+
+    hyperbusf_slow_op_t snap;
+    snap.addr = addr;
+    snap.size = size;
+    snap.duration_us = duration;
+    snap.threshold_us = _thresholds[op];
+    snap.polls = _polls - polls;
+    snap.status = _status;
+    snap.op = op;
+    snap.queue_depth = _queue_depth();
+
+    // The operation itself went through, losing its snapshot is not an error
+    _log_append(HYPERBUSF_LOG_SLOW_OP, &snap, sizeof(snap));
+}
+
+int HYPERBUSFBlockDevice::_log_init()
+{
+    hyperbusf_log_record_t record;
+    _log_head = 0;
+    _log_seq = 0;
+
+    // The newest sector is the one starting with the highest sequence
+    int newest = -1;
+    uint32_t newest_seq = 0;
+    for (int i = 0; i < HYPERBUS_LOG_SECTORS; i++) {
+        if (_log_load(i * HYPERBUS_LOG_PER_SECTOR, &record) &&
+                (newest < 0 || (int32_t)(record.seq - newest_seq) > 0)) {
+            newest = i;
+            newest_seq = record.seq;
+        }
+    }
+
+    _log_ready = true;
+    if (newest < 0) {
+        return 0;
+    }
+
+    // Records are appended in order, bisect for the first free one
+    uint32_t lo = 0;
+    uint32_t hi = HYPERBUS_LOG_PER_SECTOR;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        _hyperbus.read_block(HYPERBUS_LOG_ADDR + (newest * HYPERBUS_LOG_PER_SECTOR + mid) * sizeof(record)
+                + HYPERBUS_FILE_SYSTEM_ADDR_OFFSET, (char*)&record, sizeof(record), uHYPERBUS_Mem_Access);
+
+        if (is_blank((const uint8_t*)&record, sizeof(record))) {
+            hi = mid;
+        } else {
+            lo = mid;
+        }
+    }
+
+    _log_head = (newest * HYPERBUS_LOG_PER_SECTOR + hi) % HYPERBUS_LOG_RECORDS;
+    _log_seq = newest_seq + hi;
+
+    return 0;
+}
+
+bool HYPERBUSFBlockDevice::_log_load(uint32_t slot, hyperbusf_log_record_t *record)
+{
+    bd_addr_t addr = HYPERBUS_LOG_ADDR + slot * sizeof(*record);
+    bool suspended = _suspended;
+
+    _access(addr, sizeof(*record));
+    _hyperbus.read_block(addr + HYPERBUS_FILE_SYSTEM_ADDR_OFFSET, (char*)record, sizeof(*record), uHYPERBUS_Mem_Access);
+
+    if (!suspended) {
+        _resume();
+    }
+
+    uint32_t crc;
+    MbedCRC<POLY_32BIT_ANSI, 32> ct;
+    ct.compute(record, offsetof(hyperbusf_log_record_t, crc), &crc);
+
+    return record->seq != 0xFFFFFFFF && record->crc == crc;
+}
+
+int HYPERBUSFBlockDevice::_log_append(uint16_t type, const void *data, uint16_t length)
+{
+    MBED_ASSERT(length <= sizeof(((hyperbusf_log_record_t*)0)->data));
+
+    if (!_log_ready) {
+        return 0;
+    }
+
+    bd_addr_t addr = HYPERBUS_LOG_ADDR + _log_head * sizeof(hyperbusf_log_record_t);
+
+    // Entering a sector drops the oldest records. Slots that couldn't be
+    // erased are never programmed, logging stops until the next init()
+    if (addr % HYPERBUS_SE_SIZE == 0) {
+        _erase_sector(addr);
+        int err = _sync();
+        if (err) {
+            _log_ready = false;
+            return err;
+        }
+    }
+
+    // Past the erase the slot is used up, a failed record is just skipped
+    uint32_t seq = _log_seq++;
+    _log_head = (_log_head + 1) % HYPERBUS_LOG_RECORDS;
+
+    hyperbusf_log_record_t record;
+    memset(&record, 0, sizeof(record));
+    record.seq = seq;
+    record.type = type;
+    record.length = length;
+    record.uptime_ms = Kernel::get_ms_count();
+    memcpy(record.data, data, length);
+
+    MbedCRC<POLY_32BIT_ANSI, 32> ct;
+    ct.compute(&record, offsetof(hyperbusf_log_record_t, crc), &record.crc);
+
+    bool suspended = _suspended;
+    _program_page(addr, &record, sizeof(record));
+    int err = _sync(HYPERBUS_PROGRAM_POLL_US);
+
+    if (!suspended) {
+        _resume();
+    }
+
+    return err;
+}
+
+int HYPERBUSFBlockDevice::_log_summary()
+{
+    if (!_log_ready) {
+        return 0;
+    }
+
+    hyperbusf_log_counters_t counters;
+    counters.uptime_s = Kernel::get_ms_count() / 1000;
+    counters.syncs = _stats.syncs;
+    counters.flushes = _stats.flushes;
+    counters.pages_flushed = _stats.pages_flushed;
+    counters.read_hits = _stats.read_hits;
+    counters.read_misses = _stats.read_misses;
+    counters.slow_ops = _stats.slow_ops;
+    counters.logical_kb = _stats.wa.logical_bytes / 1024;
+    counters.programmed_kb = _stats.wa.programmed_bytes / 1024;
+    counters.erased_kb = _stats.wa.erased_bytes / 1024;
+
+    int err = _log_append(HYPERBUSF_LOG_COUNTERS, &counters, sizeof(counters));
+
+    for (int op = 0; op < HYPERBUSF_OP_COUNT && !err; op++) {
+        hyperbusf_log_latency_t latency;
+        memset(&latency, 0, sizeof(latency));
+        latency.op = op;
+        memcpy(latency.buckets, _stats.latency[op], sizeof(latency.buckets));
+
+        err = _log_append(HYPERBUSF_LOG_LATENCY, &latency, sizeof(latency));
+    }
+
+    return err;
+}
+
+int HYPERBUSFBlockDevice::log_summary()
+{
+    _mutex.lock();
+    int err = _log_summary();
+    _mutex.unlock();
+
+    return err;
+}
+
+int HYPERBUSFBlockDevice::read_log(uint32_t age, hyperbusf_log_record_t *record)
+{
+    _mutex.lock();
+
+    if (age >= _log_seq || age >= HYPERBUS_LOG_RECORDS) {
+        _mutex.unlock();
+        return HYPERBUSF_ERROR_NO_RECORD;
+    }
+
+    uint32_t slot = (_log_head + HYPERBUS_LOG_RECORDS - 1 - age) % HYPERBUS_LOG_RECORDS;
+    bool valid = _log_load(slot, record) && record->seq == _log_seq - 1 - age;
+
+    _mutex.unlock();
+    return valid ? 0 : HYPERBUSF_ERROR_NO_RECORD;
+}
+
 bd_size_t HYPERBUSFBlockDevice::get_read_size() const
 {
     return HYPERBUS_READ_SIZE;
@@ -20,6 +20,164 @@
 #include <mbed.h>
 #include "BlockDevice.h"
 
+// Size of the device write buffer, a single program never crosses it
+#define HYPERBUS_PAGE_SIZE  512
+
+// Number of cache sizes of the miss ratio curve, 1 to 32768 pages
+#define HYPERBUSF_MRC_POINTS    16
+
+// Number of latency histogram buckets, bucket i holds durations under
+// 8 << (3 * i) us, the last one everything longer
+#define HYPERBUSF_LATENCY_BUCKETS   8
+
+enum {
+    HYPERBUSF_ERROR_PROGRAM_FAILED = -4301, /*!< device reported a program failure */
+    HYPERBUSF_ERROR_ERASE_FAILED   = -4302, /*!< device reported an erase failure */
+    HYPERBUSF_ERROR_ADVICE         = -4303, /*!< advice table or pinnable cache exhausted */
+    HYPERBUSF_ERROR_NO_FRAME       = -4304, /*!< every cache frame is pinned or borrowed */
+    HYPERBUSF_ERROR_NO_PARTITION   = -4305, /*!< partition table full or unknown partition */
+    HYPERBUSF_ERROR_NO_RECORD      = -4306, /*!< log record missing or corrupt */
+};
+
+/** Operations of a HYPERBUSFBlockDevice
+ */
+typedef enum {
+    HYPERBUSF_OP_READ,      /*!< read(), read_async() */
+    HYPERBUSF_OP_PROGRAM,   /*!< program(), program_async(), copy() */
+    HYPERBUSF_OP_ERASE,     /*!< erase() */
+    HYPERBUSF_OP_SYNC,      /*!< sync() */
+    HYPERBUSF_OP_COUNT,
+} hyperbusf_op_t;
+
+/** Types of the records of the persistent log
+ */
+enum {
+    HYPERBUSF_LOG_SLOW_OP   = 1,    /*!< hyperbusf_slow_op_t */
+    HYPERBUSF_LOG_COUNTERS  = 2,    /*!< hyperbusf_log_counters_t */
+    HYPERBUSF_LOG_LATENCY   = 3,    /*!< hyperbusf_log_latency_t */
+};
+
+/** Record of the persistent log
+ *
+ *  The log fills hyperbusf-driver.log-sectors sectors right below the
+ *  remap table, or the end of the device without spares. Records are
+ *  appended in order and the oldest sector is erased when the log wraps.
+ *  Fields are little-endian, erased records read all 0xFF.
+ */
+typedef struct {
+    uint32_t seq;           /*!< number of records appended before this one */
+    uint16_t type;          /*!< HYPERBUSF_LOG_* */
+    uint16_t length;        /*!< bytes of data used */
+    uint32_t uptime_ms;     /*!< Kernel::get_ms_count() when appended */
+    uint8_t data[48];       /*!< record of the given type */
+    uint32_t crc;           /*!< CRC-32 (ANSI) of everything above */
+} hyperbusf_log_record_t;
+
+/** Snapshot of an operation that took longer than its threshold
+ */
+typedef struct {
+    uint32_t addr;          /*!< address of the operation */
+    uint32_t size;          /*!< size of the operation, 0 for sync() */
+    uint32_t duration_us;   /*!< time the operation took */
+    uint32_t threshold_us;  /*!< threshold it went over */
+    uint32_t polls;         /*!< status register polls while it ran */
+    uint16_t status;        /*!< last status register value read */
+    uint8_t op;             /*!< hyperbusf_op_t */
+    uint8_t queue_depth;    /*!< asynchronous requests waiting when it ended */
+} hyperbusf_slow_op_t;
+
+/** Counters of a performance summary, cumulative since boot
+ */
+typedef struct {
+    uint32_t uptime_s;      /*!< seconds since boot */
+    uint32_t syncs;         /*!< hyperbusf_stats_t counters */
+    uint32_t flushes;
+    uint32_t pages_flushed;
+    uint32_t read_hits;
+    uint32_t read_misses;
+    uint32_t slow_ops;
+    uint32_t logical_kb;    /*!< write amplification counters in kbytes */
+    uint32_t programmed_kb;
+    uint32_t erased_kb;
+} hyperbusf_log_counters_t;
+
+/** Latency histogram of an operation in a performance summary
+ */
+typedef struct {
+    uint8_t op;                                     /*!< hyperbusf_op_t */
+    uint8_t reserved[3];
+    uint32_t buckets[HYPERBUSF_LATENCY_BUCKETS];    /*!< operations per bucket since boot */
+} hyperbusf_log_latency_t;
+
+/** Flags of asynchronous writes
+ */
+enum {
+    HYPERBUSF_WRITE_BARRIER = (1 << 0), /*!< every earlier write is durable before this one starts */
+    HYPERBUSF_WRITE_FUA     = (1 << 1), /*!< this write is durable when it completes */
+    HYPERBUSF_WRITE_DIRECT  = (1 << 2), /*!< programmed from the caller's buffer, bypassing the cache */
+};
+
+/** Access patterns a range of a HYPERBUSFBlockDevice can be advised of
+ */
+typedef enum {
+    HYPERBUSF_ADVICE_NORMAL,     /*!< default caching, read-ahead when reads follow each other */
+    HYPERBUSF_ADVICE_SEQUENTIAL, /*!< read once in order, read-ahead and evict first */
+    HYPERBUSF_ADVICE_RANDOM,     /*!< no read-ahead */
+    HYPERBUSF_ADVICE_WILLNEED,   /*!< load the range into the cache now */
+    HYPERBUSF_ADVICE_DONTNEED,   /*!< drop the range from the cache and keep it out */
+    HYPERBUSF_ADVICE_PIN,        /*!< load the range and keep it cached */
+} hyperbusf_advice_t;
+
+/** Write amplification of a HYPERBUSFBlockDevice or one of its partitions
+ */
+typedef struct {
+    uint64_t logical_bytes;     /*!< bytes passed to program() and program_async() */
+    uint64_t programmed_bytes;  /*!< bytes programmed on the device, including write-back,
+                                     copies and relocation */
+    uint64_t erased_bytes;      /*!< bytes erased on the device */
+    uint32_t wa_permille;       /*!< programmed bytes per thousand logical bytes */
+} hyperbusf_wa_t;
+
+/** Performance counters of a HYPERBUSFBlockDevice
+ */
+typedef struct {
+    uint32_t syncs;             /*!< calls to sync() */
+    uint32_t flushes;           /*!< write-back flushes, one per group commit */
+    uint32_t pages_flushed;     /*!< dirty pages written back */
+    uint32_t read_hits;         /*!< pages read from the cache */
+    uint32_t read_misses;       /*!< pages read from the device into the cache */
+    uint32_t pages_prefetched;  /*!< pages loaded by read-ahead or advice */
+    uint32_t slow_ops;          /*!< operations over their latency threshold */
+    uint32_t latency[HYPERBUSF_OP_COUNT][HYPERBUSF_LATENCY_BUCKETS]; /*!< latency histograms */
+    hyperbusf_wa_t wa;          /*!< write amplification of the whole device */
+} hyperbusf_stats_t;
+
+/** Erase and program durations of a sector
+ */
+typedef struct {
+    uint32_t erases;            /*!< erases timed */
+    uint32_t erase_mean_us;     /*!< running mean of the erase durations */
+    uint32_t erase_max_us;      /*!< longest erase */
+    uint32_t programs;          /*!< page programs timed */
+    uint32_t program_mean_us;   /*!< running mean of the page program durations */
+    uint32_t program_max_us;    /*!< longest page program */
+    bool slow;                  /*!< sector is slower than the rest of the device */
+} hyperbusf_sector_stats_t;
+
+/** Estimated duration of an operation
+ */
+typedef struct {
+    uint32_t expected_us;       /*!< duration the operation most likely takes */
+    uint32_t worst_us;          /*!< duration it shouldn't exceed */
+} hyperbusf_estimate_t;
+
+/** Miss ratio curve estimated from the pages read
+ */
+typedef struct {
+    uint32_t references;                            /*!< page references the curve stands for */
+    uint16_t miss_permille[HYPERBUSF_MRC_POINTS];   /*!< misses per thousand references of an
+                                                         LRU cache of 1 << i pages */
+} hyperbusf_mrc_t;
 
 /** BlockDevice for HYPERBUS based flash devices
  *  such as the MX25R or SST26F016B
@@ -90,12 +248,20 @@ public:
     virtual int init();
 
     /** Deinitialize a block device
+     *
+     *  Asynchronous requests are refused from now on, the ones already
+     *  queued run to completion first. Must not be called from their
+     *  callbacks.
      *
      *  @return         0 on success or a negative error code on failure
      */
     virtual int deinit();
 
     /** Read blocks from a block device
+     *
+     *  Large reads are done in slices of read-slice-size bytes, requests
+     *  from other threads waiting on the device are let through in
+     *  between slices.
      *
      *  @param buffer   Buffer to write blocks to
      *  @param addr     Address of block to begin reading from
@@ -104,6 +270,17 @@ public:
      */
     virtual int read(void *buffer, bd_addr_t addr, bd_size_t size);
 
+    /** Ensure data on storage is in sync with the driver
+     *
+     *  With hyperbusf-driver.write-back enabled, programs are held in the
+     *  page cache until sync() writes them back. Callers arriving within
+     *  hyperbusf-driver.group-commit-window-ms of each other share a single
+     *  write-back and are all released when it completes.
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int sync();
+
     /** Program blocks to a block device
      *
      *  The blocks must have been erased prior to being programmed
@@ -119,12 +296,252 @@ public:
      *
      *  The state of an erased block is undefined until it has been programmed
      *
+     *  When hyperbusf-driver.spare-sectors is set, sectors failing to erase
+     *  or program are transparently moved to a spare sector
+     *
      *  @param addr     Address of block to begin erasing
      *  @param size     Size to erase in bytes, must be a multiple of erase block size
      *  @return         0 on success, negative error code on failure
      */
     virtual int erase(bd_addr_t addr, bd_size_t size);
 
+    /** Start erasing blocks without waiting for the erase to finish
+     *
+     *  The erase of the first sector is issued and the call returns. The
+     *  range is tracked as busy, the following sectors are issued by the
+     *  driver thread as the device becomes ready. Reads and programs of
+     *  other sectors suspend the erase while they run, only requests
+     *  touching the sector being erased, erases and sync() wait for the
+     *  erase to end. Starting another deferred erase waits for the
+     *  previous one.
+     *
+     *  Failures, once handled by bad sector remapping, are reported by the
+     *  next sync().
+     *
+     *  @param addr     Address of block to begin erasing
+     *  @param size     Size to erase in bytes, must be a multiple of erase block size
+     *  @return         0 on success, negative error code on failure
+     */
+    int erase_deferred(bd_addr_t addr, bd_size_t size);
+
+    /** Copy data from one place on the device to another
+     *
+     *  The data is streamed through two page sized buffers: the next chunk
+     *  is fetched before the current one is programmed and checked while
+     *  it programs, and chunks that are still erased are skipped. The
+     *  destination must have been erased prior to the copy and must not
+     *  overlap the source.
+     *
+     *  @param src      Address of block to begin copying from
+     *  @param dst      Address of block to begin copying to
+     *  @param size     Size to copy in bytes, must be a multiple of program block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int copy(bd_addr_t src, bd_addr_t dst, bd_size_t size);
+
+    /** Queue a program to be run in the background
+     *
+     *  Queued writes are run in order by the driver thread. Without
+     *  flags a write completes once it is in the page cache, and writes
+     *  between two barriers may reach the flash in any order. A barrier
+     *  write first makes every earlier write durable, a FUA write is
+     *  durable by the time its callback runs.
+     *
+     *  A direct write is programmed page by page straight from the
+     *  caller's buffer, without a copy into the page cache. Cached pages
+     *  it overlaps are written out and dropped first, and it is durable
+     *  by the time its callback runs. The buffer belongs to the driver
+     *  until then, the callback hands it back to the caller.
+     *
+     *  Ordering only holds between writes queued from the same thread.
+     *
+     *  Blocks while hyperbusf-driver.queue-depth requests of the calling
+     *  thread's queue are pending, must not be called from interrupt context.
+     *
+     *  @param buffer   Buffer of data to write to blocks, must stay valid
+     *                  until the callback is called
+     *  @param addr     Address of block to begin writing to
+     *  @param size     Size to write in bytes, must be a multiple of program block size
+     *  @param flags    HYPERBUSF_WRITE_BARRIER, HYPERBUSF_WRITE_FUA and
+     *                  HYPERBUSF_WRITE_DIRECT
+     *  @param func     Called from the driver thread with the result of the write
+     *  @return         0 if the write was queued, negative error code on failure
+     */
+    int program_async(const void *buffer, bd_addr_t addr, bd_size_t size, int flags,
+                      Callback<void(int)> func);
+
+    /** Queue a read to be run in the background
+     *
+     *  Requests from the same thread run in order, requests from
+     *  different threads go through separate submission queues that the
+     *  driver thread serves round-robin.
+     *
+     *  Blocks while hyperbusf-driver.queue-depth requests of the calling
+     *  thread's queue are pending, must not be called from interrupt context.
+     *
+     *  @param buffer   Buffer to write blocks to, must stay valid until
+     *                  the callback is called
+     *  @param addr     Address of block to begin reading from
+     *  @param size     Size to read in bytes, must be a multiple of read block size
+     *  @param func     Called from the driver thread with the result of the read
+     *  @return         0 if the read was queued, negative error code on failure
+     */
+    int read_async(void *buffer, bd_addr_t addr, bd_size_t size, Callback<void(int)> func);
+
+    /** Advise the driver of how a range will be accessed
+     *
+     *  Pages read through read() are kept in the page cache next to the
+     *  pages waiting to be written back. Advice steers which pages are
+     *  admitted, which are evicted first and how far ahead the driver
+     *  reads. The latest advice covering an address wins, and
+     *  HYPERBUSF_ADVICE_NORMAL returns a range to the default.
+     *
+     *  HYPERBUSF_ADVICE_WILLNEED only loads the range and is not
+     *  remembered, as many pages as the cache holds are loaded. Pinned
+     *  pages always leave one page of the cache free, and erasing a
+     *  pinned range drops its pages until they are read again.
+     *
+     *  @param addr     Address of the range
+     *  @param size     Size of the range in bytes
+     *  @param advice   Expected access pattern
+     *  @return         0 on success, HYPERBUSF_ERROR_ADVICE if
+     *                  hyperbusf-driver.advice-entries ranges are already
+     *                  advised or the range can't be pinned
+     */
+    int advise(bd_addr_t addr, bd_size_t size, hyperbusf_advice_t advice);
+
+    /** Borrow a read-only view of data in the page cache
+     *
+     *  The page holding the data is loaded into the cache if needed and
+     *  stays there until every view of it is released, so the data can be
+     *  used in place instead of being copied out by read(). Programs to
+     *  the page show through the view, erases don't.
+     *
+     *  @param addr     Address of the data
+     *  @param size     Size of the data in bytes, must not cross a page
+     *  @param data     Returns a pointer to the data
+     *  @return         0 on success, HYPERBUSF_ERROR_NO_FRAME if every page
+     *                  of the cache is pinned or borrowed
+     */
+    int borrow(bd_addr_t addr, bd_size_t size, const void **data);
+
+    /** Release a view returned by borrow()
+     *
+     *  @param data     Pointer returned by borrow()
+     */
+    void release(const void *data);
+
+    /** Get the performance counters of the device
+     *
+     *  @param stats    Returns the counters
+     */
+    void get_stats(hyperbusf_stats_t *stats);
+
+    /** Track write amplification of a range separately
+     *
+     *  Programs and erases are charged to every partition they fall in,
+     *  by their address before bad sector remapping. Writes to a spare
+     *  before the move to it is committed only count for the device.
+     *
+     *  @param addr     Address of the partition
+     *  @param size     Size of the partition in bytes
+     *  @return         Partition number on success, HYPERBUSF_ERROR_NO_PARTITION
+     *                  if hyperbusf-driver.partitions partitions are already tracked
+     */
+    int add_partition(bd_addr_t addr, bd_size_t size);
+
+    /** Get the write amplification of a partition
+     *
+     *  @param partition    Partition number returned by add_partition()
+     *  @param wa           Returns the counters of the partition
+     *  @return             0 on success, HYPERBUSF_ERROR_NO_PARTITION if
+     *                      the partition doesn't exist
+     */
+    int get_partition_stats(int partition, hyperbusf_wa_t *wa);
+
+    /** Set the latency threshold of an operation
+     *
+     *  Operations taking longer are counted in hyperbusf_stats_t and a
+     *  hyperbusf_slow_op_t snapshot of them is appended to the persistent
+     *  log when hyperbusf-driver.log-sectors is set. Asynchronous requests
+     *  are timed from when the driver thread starts them.
+     *
+     *  @param op       Operation
+     *  @param us       Threshold in microseconds, 0 disables it
+     */
+    void set_latency_threshold(hyperbusf_op_t op, uint32_t us);
+
+    /** Append a performance summary to the persistent log
+     *
+     *  A summary is a HYPERBUSF_LOG_COUNTERS record followed by a
+     *  HYPERBUSF_LOG_LATENCY record for each operation. Summaries are also
+     *  appended every hyperbusf-driver.log-summary-period-s seconds by the
+     *  driver thread and by deinit().
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    int log_summary();
+
+    /** Read a record of the persistent log
+     *
+     *  @param age      Number of records appended after it, 0 is the newest
+     *  @param record   Returns the record
+     *  @return         0 on success, HYPERBUSF_ERROR_NO_RECORD if the record
+     *                  was overwritten or fails its CRC
+     */
+    int read_log(uint32_t age, hyperbusf_log_record_t *record);
+
+    /** Get the erase and program durations of a sector
+     *
+     *  Every erase and page program is timed from the command to the
+     *  device reporting ready, and charged to the physical sector it ran
+     *  on. Counts saturate at 65535, after which the means follow recent
+     *  durations.
+     *
+     *  @param addr     Address in the sector
+     *  @param stats    Returns the durations
+     */
+    void get_sector_stats(bd_addr_t addr, hyperbusf_sector_stats_t *stats);
+
+    /** Estimate how long an operation will take on the device
+     *
+     *  Reads follow the bus timing. Programs and erases use the mean
+     *  durations measured on the sectors they touch, falling back to the
+     *  device mean and then to the datasheet while there are no samples.
+     *  The worst case is the datasheet maximum, or the longest duration
+     *  seen on the sector if it exceeds it. Programs are estimated as if
+     *  written through, sync() by the pages waiting to be written back.
+     *
+     *  @param op       Operation
+     *  @param addr     Address of the operation, ignored for sync()
+     *  @param size     Size of the operation in bytes, ignored for sync()
+     *  @param estimate Returns the estimated durations
+     */
+    void estimate(hyperbusf_op_t op, bd_addr_t addr, bd_size_t size, hyperbusf_estimate_t *estimate);
+
+    /** Tell whether a sector is wearing out
+     *
+     *  A sector is slow once its mean erase or program duration exceeds
+     *  hyperbusf-driver.slow-sector-percent percent of the device mean.
+     *  Allocators can use this to keep data away from degrading sectors.
+     *
+     *  @param addr     Address in the sector
+     *  @return         True if the sector is slow
+     */
+    bool is_slow_sector(bd_addr_t addr);
+
+    /** Get the miss ratio curve of the reads so far
+     *
+     *  Pages read through read() and read_async() are sampled by the hash
+     *  of their address, and the reuse distance of the sampled pages is
+     *  measured against each other (SHARDS). The sample is bounded by
+     *  hyperbusf-driver.mrc-samples pages, the rate drops as new pages
+     *  come in so the cost stays constant whatever the working set.
+     *
+     *  @param mrc      Returns the curve, all zero if nothing was sampled
+     */
+    void get_miss_ratio_curve(hyperbusf_mrc_t *mrc);
+
     /** Get the size of a readable block
      *
      *  @return         Size of a readable block in bytes
@@ -170,9 +587,207 @@ private:
     // Device configuration discovered through sfdp
     bd_size_t _size;
 
+    // Bad sector remapping, physical sector of every logical sector
+    uint16_t *_remap;
+    uint32_t _remap_entries;
+    uint32_t _spares_used;
+
+    // Page cache holding pages read and programs until they are written
+    // back, data of a page not valid is erased outside of lo..hi. Borrowed
+    // frames are detached rather than freed when dropped
+    struct frame {
+        bd_addr_t addr;
+        uint16_t lo;
+        uint16_t hi;
+        uint16_t refs;
+        uint32_t stamp;
+        bool valid;
+        bool cold;
+        bool pinned;
+        uint8_t data[HYPERBUS_PAGE_SIZE];
+    };
+    frame _frames[MBED_CONF_HYPERBUSF_DRIVER_CACHE_PAGES];
+    uint32_t _stamp;
+    int _pinned;
+
+    // Advised ranges, newest last
+    struct advice {
+        bd_addr_t addr;
+        bd_size_t size;
+        hyperbusf_advice_t advice;
+    };
+    advice _advice[MBED_CONF_HYPERBUSF_DRIVER_ADVICE_ENTRIES];
+    int _advice_count;
+    bd_addr_t _read_next;
+
+    // Reuse distance sampling of the pages read, counts are scaled to
+    // the current sampling threshold
+    struct mrc_sample {
+        uint32_t page;
+        uint32_t hash;
+        uint32_t last;
+    };
+    mrc_sample _mrc_samples[MBED_CONF_HYPERBUSF_DRIVER_MRC_SAMPLES ?
+                            MBED_CONF_HYPERBUSF_DRIVER_MRC_SAMPLES : 1];
+    int _mrc_count;
+    uint32_t _mrc_threshold;
+    uint32_t _mrc_clock;
+    uint32_t _mrc_refs;
+    uint32_t _mrc_cold;
+    uint32_t _mrc_hist[HYPERBUSF_MRC_POINTS + 1];
+
+    // Group commit, sync() callers join the open batch
+    Mutex _mutex;
+    ConditionVariable _commit_cond;
+    uint32_t _commit_open;
+    uint32_t _commit_done;
+    int _commit_err;
+    bool _committing;
+
+    hyperbusf_stats_t _stats;
+
+    // Latency watchdog, polls and status are those of the last _sync()
+    Timer _timer;
+    uint32_t _thresholds[HYPERBUSF_OP_COUNT];
+    uint32_t _polls;
+    uint16_t _status;
+
+    // Duration telemetry of every physical sector, and of the command
+    // the device is busy with
+    struct sector_telemetry {
+        uint32_t erase_mean;
+        uint32_t erase_max;
+        uint32_t program_mean;
+        uint32_t program_max;
+        uint16_t erases;
+        uint16_t programs;
+    };
+    sector_telemetry *_telemetry;
+    uint32_t _erase_mean;
+    uint32_t _erase_count;
+    uint32_t _program_mean;
+    uint32_t _program_count;
+    int _busy_op;
+    uint32_t _busy_sector;
+    uint64_t _busy_start;
+
+    // Deferred erase, the sector erasing and the end of the range
+    bd_addr_t _erase_next;
+    bd_addr_t _erase_end;
+    int _erase_err;
+
+    // Erase suspended for accesses to other sectors, with the telemetry
+    // of the erase set aside meanwhile
+    bool _suspended;
+    uint64_t _suspend_time;
+    uint64_t _resume_time;
+    uint32_t _suspended_sector;
+    uint64_t _suspended_start;
+
+    // Persistent log, next slot to write and its sequence number
+    uint32_t _log_head;
+    uint32_t _log_seq;
+    bool _log_ready;
+    uint64_t _summary_next;
+
+    // Ranges write amplification is tracked for
+    struct partition {
+        bd_addr_t addr;
+        bd_size_t size;
+        hyperbusf_wa_t wa;
+    };
+    partition _partitions[MBED_CONF_HYPERBUSF_DRIVER_PARTITIONS ?
+                          MBED_CONF_HYPERBUSF_DRIVER_PARTITIONS : 1];
+    int _partition_count;
+
+    // Requests queued for the driver thread, one submission queue per
+    // group of threads so submitters don't contend on a single lock
+    struct request {
+        request *next;
+        int op;
+        int flags;
+        void *buffer;
+        bd_addr_t addr;
+        bd_size_t size;
+        Callback<void(int)> callback;
+    };
+    struct queue {
+        Mutex lock;
+        Semaphore slots;
+        request *free;
+        request *head;
+        request *tail;
+        request requests[MBED_CONF_HYPERBUSF_DRIVER_QUEUE_DEPTH];
+
+        queue();
+    };
+    queue _queues[MBED_CONF_HYPERBUSF_DRIVER_SUBMIT_QUEUES];
+    Semaphore _queue_ready;
+    int _queue_next;
+    Thread _worker;
+    bool _worker_started;
+
+    // Requests are only taken between init() and deinit(), which waits
+    // for the queued ones to complete
+    bool _accepting;
+    uint32_t _pending;
+    ConditionVariable _drained;
+
+    // Ping-pong buffers for copy()
+    uint8_t _copy_buffer[2][HYPERBUS_PAGE_SIZE];
+
     // Internal functions
     int _wren();
-    int _sync();
+    int _read(void *buffer, bd_addr_t addr, bd_size_t size);
+    int _program(const void *buffer, bd_addr_t addr, bd_size_t size);
+    int _erase(bd_addr_t addr, bd_size_t size);
+    int _sync(int poll_us = 1000);
+    bool _ready();
+    void _settle(bool wait = true);
+    bool _erase_step(bool wait);
+    bool _erasing(bd_addr_t addr, bd_size_t size);
+    void _access(bd_addr_t addr, bd_size_t size);
+    bool _suspend();
+    void _resume();
+    void _program_page(bd_addr_t addr, const void *buffer, bd_size_t size);
+    void _erase_sector(bd_addr_t addr);
+    int _copy(bd_addr_t src, bd_addr_t dst, bd_size_t size);
+    void _telemetry_done();
+    void _estimate_page(bd_addr_t addr, uint64_t *expected, uint64_t *worst);
+    bool _slow(const sector_telemetry *t) const;
+    bd_addr_t _phys(bd_addr_t addr) const;
+    bd_addr_t _logical(bd_addr_t addr) const;
+    void _account(uint64_t hyperbusf_wa_t::*counter, bd_addr_t addr, bd_size_t size);
+    int _remap_init();
+    int _remap_sector(uint32_t sector, bd_addr_t skip, bd_size_t skip_size, int err);
+    frame *_frame_find(bd_addr_t page);
+    int _frame_get(bd_addr_t page, frame **f);
+    int _frame_fill(bd_addr_t page, hyperbusf_advice_t advice, frame **f);
+    void _frame_touch(frame *f, hyperbusf_advice_t advice);
+    void _frame_release(frame *f);
+    hyperbusf_advice_t _advised(bd_addr_t addr) const;
+    int _cache_read(void *buffer, bd_addr_t addr, bd_size_t size, bool fits, bool streaming, bool last);
+    int _read_sliced(void *buffer, bd_addr_t addr, bd_size_t size);
+    void _mrc_access(uint32_t page);
+    void _mrc_scale(uint32_t threshold);
+    void _cache_update(const void *buffer, bd_addr_t addr, bd_size_t size);
+    int _frame_flush(frame *f);
+    int _cache_flush();
+    int _cache_program(const void *buffer, bd_addr_t addr, bd_size_t size);
+    void _cache_merge(void *buffer, bd_addr_t addr, bd_size_t size);
+    void _cache_drop(bd_addr_t addr, bd_size_t size);
+    bool _dirty() const;
+    int _cache_flush_range(bd_addr_t addr, bd_size_t size);
+    void _watch(hyperbusf_op_t op, bd_addr_t addr, bd_size_t size, uint64_t start, uint32_t polls);
+    int _queue_depth();
+    int _log_init();
+    bool _log_load(uint32_t slot, hyperbusf_log_record_t *record);
+    int _log_append(uint16_t type, const void *data, uint16_t length);
+    int _log_summary();
+    int _submit(int op, void *buffer, bd_addr_t addr, bd_size_t size, int flags,
+                Callback<void(int)> func);
+    void _dispatch();
+    int _execute(request *r);
 };
 
 
@@ -0,0 +1,219 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 2018 GreenWaves Technologies
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "OverlayManager.h"
+
+
+OverlayManager::OverlayManager(HYPERBUSFBlockDevice *bd, void *slots, bd_size_t slot_size, int slot_count) :
+    _bd(bd), _memory(static_cast<uint8_t*>(slots)), _slot_size(slot_size),
+    _slot_count(slot_count), _stamp(0), _cond(_mutex)
+{
+    MBED_STATIC_ASSERT(OVERLAY_MAX <= 32, "callees of an overlay are kept in a 32-bit mask");
+    MBED_ASSERT(slot_count > 0 && slot_count <= OVERLAY_SLOTS);
+
+    for (int i = 0; i < OVERLAY_SLOTS; i++) {
+        _slots[i].owner = this;
+        _slots[i].id = -1;
+        _slots[i].state = SLOT_EMPTY;
+        _slots[i].pins = 0;
+        _slots[i].err = 0;
+        _slots[i].stamp = 0;
+    }
+
+    for (int i = 0; i < OVERLAY_MAX; i++) {
+        _overlays[i].addr = 0;
+        _overlays[i].size = 0;
+        _overlays[i].slot = -1;
+        _overlays[i].callees = 0;
+    }
+}
+
+int OverlayManager::add(int id, bd_addr_t addr, bd_size_t size)
+{
+    MBED_ASSERT(id >= 0 && id < OVERLAY_MAX);
+    MBED_ASSERT(size > 0 && size <= _slot_size);
+    MBED_ASSERT(size % _bd->get_read_size() == 0);
+
+    _mutex.lock();
+    _overlays[id].addr = addr;
+    _overlays[id].size = size;
+    _mutex.unlock();
+
+    return 0;
+}
+
+int OverlayManager::add_edge(int from, int to)
+{
+    MBED_ASSERT(from >= 0 && from < OVERLAY_MAX);
+    MBED_ASSERT(to >= 0 && to < OVERLAY_MAX);
+
+    _mutex.lock();
+    _overlays[from].callees |= 1UL << to;
+    _mutex.unlock();
+
+    return 0;
+}
+
+void OverlayManager::slot::loaded(int err)
+{
+    // Runs on the driver thread once the DMA transfer is done
+    owner->_mutex.lock();
+    this->err = err;
+    state = SLOT_READY;
+    owner->_cond.notify_all();
+    owner->_mutex.unlock();
+}
+
+int OverlayManager::_victim() const
+{
+    int best = -1;
+    for (int i = 0; i < _slot_count; i++) {
+        const slot *s = &_slots[i];
+        if (s->state == SLOT_EMPTY) {
+            return i;
+        }
+
+        if (s->state == SLOT_READY && s->pins == 0 &&
+                (best < 0 || (int32_t)(s->stamp - _slots[best].stamp) < 0)) {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+void OverlayManager::_claim(int id, int s)
+{
+    slot *sl = &_slots[s];
+    if (sl->id >= 0) {
+        _overlays[sl->id].slot = -1;
+    }
+
+    sl->id = id;
+    sl->state = SLOT_LOADING;
+    sl->err = 0;
+    sl->stamp = ++_stamp;
+    _overlays[id].slot = s;
+}
+
+void OverlayManager::_start(int s)
+{
+    // Called without the mutex, queueing may wait for the driver thread
+    // which completes loads under it
+    slot *sl = &_slots[s];
+    overlay *ov = &_overlays[sl->id];
+
+    int err = _bd->read_async(&_memory[s * _slot_size], ov->addr, ov->size,
+            callback(sl, &slot::loaded));
+    if (err) {
+        // Fails like a load, the next load() of the overlay retries it
+        sl->loaded(err);
+    }
+}
+
+int OverlayManager::_prefetch(int id, int *slots)
+{
+    uint32_t callees = _overlays[id].callees;
+    int count = 0;
+
+    for (int i = 0; callees; i++, callees >>= 1) {
+        if (!(callees & 1) || _overlays[i].slot >= 0 || !_overlays[i].size) {
+            continue;
+        }
+
+        // Best effort, give up as soon as every slot is busy
+        int s = _victim();
+        if (s < 0) {
+            break;
+        }
+
+        _claim(i, s);
+        slots[count++] = s;
+    }
+
+    return count;
+}
+
+int OverlayManager::load(int id, void **addr)
+{
+    MBED_ASSERT(id >= 0 && id < OVERLAY_MAX && _overlays[id].size);
+
+    _mutex.lock();
+
+    overlay *ov = &_overlays[id];
+
+    // A failed prefetch is retried like a miss
+    if (ov->slot >= 0 && _slots[ov->slot].state == SLOT_READY && _slots[ov->slot].err) {
+        _slots[ov->slot].id = -1;
+        _slots[ov->slot].state = SLOT_EMPTY;
+        ov->slot = -1;
+    }
+
+    // Slots are claimed under the mutex, their reads queued after it
+    int slots[OVERLAY_MAX + 1];
+    int count = 0;
+
+    if (ov->slot < 0) {
+        int s = _victim();
+        if (s < 0) {
+            _mutex.unlock();
+            return OVERLAY_ERROR_NO_SLOT;
+        }
+
+        _claim(id, s);
+        slots[count++] = s;
+    }
+
+    slot *sl = &_slots[ov->slot];
+    sl->pins += 1;
+    sl->stamp = ++_stamp;
+
+    // Queued behind the demand load, so they never delay it
+    count += _prefetch(id, &slots[count]);
+
+    _mutex.unlock();
+    for (int i = 0; i < count; i++) {
+        _start(slots[i]);
+    }
+    _mutex.lock();
+
+    while (sl->state == SLOT_LOADING) {
+        _cond.wait();
+    }
+
+    int err = sl->err;
+    if (err) {
+        sl->pins -= 1;
+    } else {
+        *addr = &_memory[(sl - _slots) * _slot_size];
+    }
+
+    _mutex.unlock();
+    return err;
+}
+
+void OverlayManager::release(int id)
+{
+    MBED_ASSERT(id >= 0 && id < OVERLAY_MAX);
+
+    _mutex.lock();
+
+    int s = _overlays[id].slot;
+    MBED_ASSERT(s >= 0 && _slots[s].pins > 0);
+    _slots[s].pins -= 1;
+
+    _mutex.unlock();
+}
@@ -0,0 +1,150 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 2018 GreenWaves Technologies
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MBED_OVERLAY_MANAGER_H
+#define MBED_OVERLAY_MANAGER_H
+
+#include <mbed.h>
+#include "HYPERBUSFBlockDevice.h"
+
+
+#define OVERLAY_MAX     MBED_CONF_HYPERBUSF_DRIVER_MAX_OVERLAYS
+#define OVERLAY_SLOTS   MBED_CONF_HYPERBUSF_DRIVER_OVERLAY_SLOTS
+
+enum {
+    OVERLAY_ERROR_NO_SLOT = -4601, /*!< every slot holds an overlay in use */
+};
+
+/** Demand loaded code and data overlays
+ *
+ *  Overlays are extents of the flash identified by a small ID. They are
+ *  loaded on demand into a fixed set of equally sized slots in L2 with
+ *  HYPERBUSFBlockDevice::read_async(), so the transfer runs by DMA from
+ *  the driver thread. Slots keep their overlay after release() and are
+ *  reused least recently used first, so overlays called often stay
+ *  resident.
+ *
+ *  The application may declare its call graph with add_edge(). Loading
+ *  an overlay then also starts loading the overlays it calls into the
+ *  free or least recently used slots, so they are often resident by the
+ *  time they are needed.
+ *
+ *  @code
+ *  static uint8_t slots[4][16 * 1024];
+ *  OverlayManager overlays(&hyperbusf, slots, sizeof(slots[0]), 4);
+ *
+ *  overlays.add(OVERLAY_DETECT, detect_addr, detect_size);
+ *  overlays.add(OVERLAY_TRACK, track_addr, track_size);
+ *  overlays.add_edge(OVERLAY_DETECT, OVERLAY_TRACK);
+ *
+ *  void *code;
+ *  overlays.load(OVERLAY_DETECT, &code);
+ *  // invalidate the instruction cache before running it
+ *  overlays.release(OVERLAY_DETECT);
+ *  @endcode
+ *
+ *  @note Synchronization level: thread safe
+ */
+class OverlayManager {
+public:
+    /** Creates an OverlayManager
+     *
+     *  @param bd           Device the overlays are stored on
+     *  @param slots        Memory holding slot_count slots of slot_size bytes
+     *  @param slot_size    Size of a slot, the largest overlay that can be loaded
+     *  @param slot_count   Number of slots, at most hyperbusf-driver.overlay-slots
+     */
+    OverlayManager(HYPERBUSFBlockDevice *bd, void *slots, bd_size_t slot_size, int slot_count);
+
+    /** Declare an overlay
+     *
+     *  @param id       Overlay ID, less than hyperbusf-driver.max-overlays
+     *  @param addr     Address of the overlay on the device
+     *  @param size     Size of the overlay, at most the slot size
+     *  @return         0 on success or a negative error code on failure
+     */
+    int add(int id, bd_addr_t addr, bd_size_t size);
+
+    /** Declare that an overlay calls into another one
+     *
+     *  @param from     Calling overlay
+     *  @param to       Called overlay, prefetched whenever from is loaded
+     *  @return         0 on success or a negative error code on failure
+     */
+    int add_edge(int from, int to);
+
+    /** Make an overlay resident and keep it there until released
+     *
+     *  @param id       Overlay to load
+     *  @param addr     Returns the address the overlay was loaded at
+     *  @return         0 on success, OVERLAY_ERROR_NO_SLOT if no slot can
+     *                  be reused, negative error code on failure
+     */
+    int load(int id, void **addr);
+
+    /** Allow the slot of an overlay to be reused
+     *
+     *  The overlay stays resident until its slot is needed for another one.
+     *
+     *  @param id       Overlay previously returned by load()
+     */
+    void release(int id);
+
+private:
+    enum slot_state {
+        SLOT_EMPTY,
+        SLOT_LOADING,
+        SLOT_READY,
+    };
+
+    struct slot {
+        OverlayManager *owner;
+        int id;
+        int state;
+        int pins;
+        int err;
+        uint32_t stamp;
+
+        void loaded(int err);
+    };
+
+    struct overlay {
+        bd_addr_t addr;
+        bd_size_t size;
+        int slot;
+        uint32_t callees;
+    };
+
+    HYPERBUSFBlockDevice *_bd;
+    uint8_t *_memory;
+    bd_size_t _slot_size;
+    int _slot_count;
+    slot _slots[OVERLAY_SLOTS];
+    overlay _overlays[OVERLAY_MAX];
+    uint32_t _stamp;
+
+    Mutex _mutex;
+    ConditionVariable _cond;
+
+    // Internal functions
+    int _victim() const;
+    void _claim(int id, int s);
+    void _start(int s);
+    int _prefetch(int id, int *slots);
+};
+
+
+#endif  /* MBED_OVERLAY_MANAGER_H */
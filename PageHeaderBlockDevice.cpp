@@ -0,0 +1,334 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 2018 GreenWaves Technologies
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "PageHeaderBlockDevice.h"
+
+struct page_header {
+    uint32_t seq;
+    uint32_t crc;
+};
+
+
+PageHeaderBlockDevice::PageHeaderBlockDevice(BlockDevice *bd) :
+    _bd(bd), _seq(0)
+{
+    MBED_STATIC_ASSERT(sizeof(struct page_header) == PAGE_HEADER_SIZE,
+            "page header does not match PAGE_HEADER_SIZE");
+}
+
+int PageHeaderBlockDevice::init()
+{
+    int err = _bd->init();
+    if (err) {
+        return err;
+    }
+
+    MBED_ASSERT(_bd->get_erase_size() % PAGE_HEADER_PAGE_SIZE == 0);
+    MBED_ASSERT(PAGE_HEADER_PAGE_SIZE % _bd->get_program_size() == 0);
+
+    return 0;
+}
+
+int PageHeaderBlockDevice::deinit()
+{
+    return _bd->deinit();
+}
+
+int PageHeaderBlockDevice::sync()
+{
+    return _bd->sync();
+}
+
+bd_addr_t PageHeaderBlockDevice::_phys(bd_addr_t addr) const
+{
+    return (addr / PAGE_HEADER_DATA_SIZE) * PAGE_HEADER_PAGE_SIZE
+         + PAGE_HEADER_SIZE + addr % PAGE_HEADER_DATA_SIZE;
+}
+
+uint32_t PageHeaderBlockDevice::_crc(uint32_t seq, const uint8_t *data) const
+{
+    MbedCRC<POLY_32BIT_ANSI, 32> ct;
+    uint32_t crc = 0;
+
+    ct.compute_partial_start(&crc);
+    ct.compute_partial(&seq, sizeof(seq), &crc);
+    ct.compute_partial(data, PAGE_HEADER_DATA_SIZE, &crc);
+    ct.compute_partial_stop(&crc);
+
+    return crc;
+}
+
+int PageHeaderBlockDevice::read(void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    // Check the address and size fit onto the chip.
+    MBED_ASSERT(is_valid_read(addr, size));
+
+    while (size > 0) {
+        bd_size_t off = addr % PAGE_HEADER_DATA_SIZE;
+        bd_size_t chunk = (off + size < PAGE_HEADER_DATA_SIZE) ? size : (PAGE_HEADER_DATA_SIZE - off);
+
+        int err = _bd->read(buffer, _phys(addr), chunk);
+        if (err) {
+            return err;
+        }
+
+        buffer = static_cast<uint8_t*>(buffer) + chunk;
+        addr += chunk;
+        size -= chunk;
+    }
+
+    return 0;
+}
+
+int PageHeaderBlockDevice::program(const void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    // Check the address and size fit onto the chip.
+    MBED_ASSERT(is_valid_program(addr, size));
+
+    struct page_header *header = (struct page_header *)_page;
+
+    while (size > 0) {
+        // Header and data go out in a single page program
+        header->seq = _seq;
+        memcpy(&_page[PAGE_HEADER_SIZE], buffer, PAGE_HEADER_DATA_SIZE);
+        header->crc = _crc(header->seq, &_page[PAGE_HEADER_SIZE]);
+
+        int err = _bd->program(_page, _phys(addr) - PAGE_HEADER_SIZE, PAGE_HEADER_PAGE_SIZE);
+        if (err) {
+            return err;
+        }
+
+        _seq += 1;
+
+        buffer = static_cast<const uint8_t*>(buffer) + PAGE_HEADER_DATA_SIZE;
+        addr += PAGE_HEADER_DATA_SIZE;
+        size -= PAGE_HEADER_DATA_SIZE;
+    }
+
+    return 0;
+}
+
+int PageHeaderBlockDevice::erase(bd_addr_t addr, bd_size_t size)
+{
+    // Check the address and size fit onto the chip.
+    MBED_ASSERT(is_valid_erase(addr, size));
+
+    return _bd->erase(_phys(addr) - PAGE_HEADER_SIZE,
+            size / PAGE_HEADER_DATA_SIZE * PAGE_HEADER_PAGE_SIZE);
+}
+
+int PageHeaderBlockDevice::check(bd_addr_t addr, page_header_state *state, uint32_t *seq)
+{
+    MBED_ASSERT(addr % PAGE_HEADER_DATA_SIZE == 0 && addr < size());
+
+    int err = _bd->read(_page, _phys(addr) - PAGE_HEADER_SIZE, PAGE_HEADER_PAGE_SIZE);
+    if (err) {
+        return err;
+    }
+
+    bool blank = true;
+    for (int i = 0; i < PAGE_HEADER_PAGE_SIZE; i++) {
+        if (_page[i] != 0xFF) {
+            blank = false;
+            break;
+        }
+    }
+
+    const struct page_header *header = (const struct page_header *)_page;
+    if (blank) {
+        *state = PAGE_HEADER_ERASED;
+    } else if (header->crc == _crc(header->seq, &_page[PAGE_HEADER_SIZE])) {
+        *state = PAGE_HEADER_VALID;
+        if (seq) {
+            *seq = header->seq;
+        }
+    } else {
+        *state = PAGE_HEADER_TORN;
+    }
+
+    return 0;
+}
+
+int PageHeaderBlockDevice::validate(bd_addr_t addr, bd_size_t size, bd_addr_t *torn)
+{
+    MBED_ASSERT(addr % PAGE_HEADER_DATA_SIZE == 0 && size % PAGE_HEADER_DATA_SIZE == 0);
+
+    while (size > 0) {
+        page_header_state state;
+        uint32_t seq;
+
+        int err = check(addr, &state, &seq);
+        if (err) {
+            return err;
+        }
+
+        if (state == PAGE_HEADER_TORN) {
+            if (torn) {
+                *torn = addr;
+            }
+            return PAGE_HEADER_BD_ERROR_TORN;
+        }
+
+        // Keep sequence numbers increasing across resets
+        if (state == PAGE_HEADER_VALID && (int32_t)(seq - _seq) >= 0) {
+            _seq = seq + 1;
+        }
+
+        addr += PAGE_HEADER_DATA_SIZE;
+        size -= PAGE_HEADER_DATA_SIZE;
+    }
+
+    return 0;
+}
+
+int PageHeaderBlockDevice::find_head(bd_addr_t start, bd_size_t size, bd_addr_t *head)
+{
+    bd_size_t sector_size = get_erase_size();
+    MBED_ASSERT(start % sector_size == 0 && size % sector_size == 0 && size > 0);
+
+    uint32_t sectors = size / sector_size;
+    uint32_t pages = sector_size / PAGE_HEADER_DATA_SIZE;
+    page_header_state state;
+    uint32_t seq;
+
+    // Find a sector the log has reached to compare the others against
+    uint32_t first = 0;
+    uint32_t first_seq = 0;
+    for (; first < sectors; first++) {
+        int err = check(start + first * sector_size, &state, &first_seq);
+        if (err) {
+            return err;
+        }
+
+        if (state == PAGE_HEADER_VALID) {
+            break;
+        }
+    }
+
+    if (first == sectors) {
+        *head = start;
+        return 0;
+    }
+
+    // Going around the ring from there, sectors written later have
+    // higher sequence numbers up to the head, then come erased or older
+    // sectors, so the newest one can be bisected
+    uint32_t lo = 0;
+    uint32_t hi = sectors - 1;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo + 1) / 2;
+
+        int err = check(start + ((first + mid) % sectors) * sector_size, &state, &seq);
+        if (err) {
+            return err;
+        }
+
+        if (state == PAGE_HEADER_VALID && (int32_t)(seq - first_seq) >= 0) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    bd_addr_t sector = start + ((first + lo) % sectors) * sector_size;
+
+    // Pages of a sector are programmed in order, bisect the last one
+    lo = 0;
+    hi = pages - 1;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo + 1) / 2;
+
+        int err = check(sector + mid * PAGE_HEADER_DATA_SIZE, &state);
+        if (err) {
+            return err;
+        }
+
+        if (state != PAGE_HEADER_ERASED) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    bd_addr_t last = sector + lo * PAGE_HEADER_DATA_SIZE;
+    int err = check(last, &state, &seq);
+    if (err) {
+        return err;
+    }
+
+    if (state == PAGE_HEADER_TORN) {
+        *head = last;
+        return PAGE_HEADER_BD_ERROR_TORN;
+    }
+
+    if ((int32_t)(seq - _seq) >= 0) {
+        _seq = seq + 1;
+    }
+
+    *head = last + PAGE_HEADER_DATA_SIZE;
+    if (*head == start + size) {
+        *head = start;
+    }
+
+    // The first page of the next sector may have been torn
+    if (lo == pages - 1) {
+        err = check(*head, &state);
+        if (err) {
+            return err;
+        }
+
+        if (state == PAGE_HEADER_TORN) {
+            return PAGE_HEADER_BD_ERROR_TORN;
+        }
+    }
+
+    return 0;
+}
+
+uint32_t PageHeaderBlockDevice::get_sequence() const
+{
+    return _seq;
+}
+
+void PageHeaderBlockDevice::set_sequence(uint32_t seq)
+{
+    _seq = seq;
+}
+
+bd_size_t PageHeaderBlockDevice::get_read_size() const
+{
+    return _bd->get_read_size();
+}
+
+bd_size_t PageHeaderBlockDevice::get_program_size() const
+{
+    return PAGE_HEADER_DATA_SIZE;
+}
+
+bd_size_t PageHeaderBlockDevice::get_erase_size() const
+{
+    return _bd->get_erase_size() / PAGE_HEADER_PAGE_SIZE * PAGE_HEADER_DATA_SIZE;
+}
+
+bd_size_t PageHeaderBlockDevice::size() const
+{
+    return _bd->size() / PAGE_HEADER_PAGE_SIZE * PAGE_HEADER_DATA_SIZE;
+}
+
+int PageHeaderBlockDevice::get_erase_value() const
+{
+    return _bd->get_erase_value();
+}
@@ -0,0 +1,210 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 2018 GreenWaves Technologies
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MBED_PAGE_HEADER_BLOCK_DEVICE_H
+#define MBED_PAGE_HEADER_BLOCK_DEVICE_H
+
+#include <mbed.h>
+#include "BlockDevice.h"
+
+
+// Size of a physical page and of the header embedded in it
+#define PAGE_HEADER_PAGE_SIZE   512
+#define PAGE_HEADER_SIZE        8
+#define PAGE_HEADER_DATA_SIZE   (PAGE_HEADER_PAGE_SIZE - PAGE_HEADER_SIZE)
+
+enum {
+    PAGE_HEADER_BD_ERROR_TORN = -4501, /*!< a page was only partially programmed */
+};
+
+/** State of a page as found by PageHeaderBlockDevice::check()
+ */
+enum page_header_state {
+    PAGE_HEADER_ERASED,     /*!< never programmed */
+    PAGE_HEADER_VALID,      /*!< header and CRC match the data */
+    PAGE_HEADER_TORN,       /*!< program was interrupted */
+};
+
+/** Block device detecting torn writes
+ *
+ *  Every 512-byte page of the underlying device starts with a header
+ *  holding a sequence number and a CRC32 over the sequence number and
+ *  the rest of the page, so a program cut short by a reset is caught by
+ *  the CRC. Programs cover whole pages of PAGE_HEADER_DATA_SIZE bytes
+ *  and take the next sequence number.
+ *
+ *  Nothing is checked on read. After a reset, validate() only needs to
+ *  be run over the pages that may have been in flight, typically the
+ *  tail of a log, instead of rescanning the whole region.
+ *
+ *  @note Synchronization level: not protected
+ */
+class PageHeaderBlockDevice : public BlockDevice {
+public:
+    /** Creates a PageHeaderBlockDevice on top of another block device
+     *
+     *  @param bd       Block device to back the PageHeaderBlockDevice
+     */
+    PageHeaderBlockDevice(BlockDevice *bd);
+
+    /** Initialize a block device
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int init();
+
+    /** Deinitialize a block device
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int deinit();
+
+    /** Ensure data on storage is in sync with the driver
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int sync();
+
+    /** Read blocks from a block device
+     *
+     *  @param buffer   Buffer to write blocks to
+     *  @param addr     Address of block to begin reading from
+     *  @param size     Size to read in bytes, must be a multiple of read block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int read(void *buffer, bd_addr_t addr, bd_size_t size);
+
+    /** Program blocks to a block device
+     *
+     *  The blocks must have been erased prior to being programmed
+     *
+     *  @param buffer   Buffer of data to write to blocks
+     *  @param addr     Address of block to begin writing to
+     *  @param size     Size to write in bytes, must be a multiple of program block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size);
+
+    /** Erase blocks on a block device
+     *
+     *  The state of an erased block is undefined until it has been programmed
+     *
+     *  @param addr     Address of block to begin erasing
+     *  @param size     Size to erase in bytes, must be a multiple of erase block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int erase(bd_addr_t addr, bd_size_t size);
+
+    /** Check the header of a single page
+     *
+     *  @param addr     Address of the page, a multiple of the program size
+     *  @param state    Returns the state of the page
+     *  @param seq      Returns the sequence number of a valid page, may be NULL
+     *  @return         0 on success or a negative error code on failure
+     */
+    int check(bd_addr_t addr, page_header_state *state, uint32_t *seq = NULL);
+
+    /** Check the pages of a range, typically the tail of a log at mount
+     *
+     *  Sequence numbers of the following programs are moved past the
+     *  highest one found.
+     *
+     *  @param addr     Address of the first page, a multiple of the program size
+     *  @param size     Size of the range, a multiple of the program size
+     *  @param torn     Returns the address of the first torn page, may be NULL
+     *  @return         0 if no page is torn, PAGE_HEADER_BD_ERROR_TORN if
+     *                  one is, negative error code on failure
+     */
+    int validate(bd_addr_t addr, bd_size_t size, bd_addr_t *torn = NULL);
+
+    /** Find the write head of a circular log at mount
+     *
+     *  The log is expected to program its pages in order, wrapping from
+     *  the end of the range back to its start and erasing sectors ahead
+     *  of the head. The sector holding the head is found with a binary
+     *  search on the sequence numbers of the first page of each sector,
+     *  then the head itself with a binary search on the pages of that
+     *  sector, taking O(log n) page reads instead of a scan. Only an
+     *  erased first sector makes the search scan forward to the first
+     *  sector the log has reached.
+     *
+     *  Sequence numbers of the following programs are moved past the
+     *  one of the last page found.
+     *
+     *  @param start    Address of the log, a multiple of the erase size
+     *  @param size     Size of the log, a multiple of the erase size
+     *  @param head     Returns the address the next page should be programmed to
+     *  @return         0 on success, PAGE_HEADER_BD_ERROR_TORN if the page
+     *                  at the head was torn, negative error code on failure
+     */
+    int find_head(bd_addr_t start, bd_size_t size, bd_addr_t *head);
+
+    /** Get the sequence number the next programmed page will take
+     *
+     *  @return         Sequence number
+     */
+    uint32_t get_sequence() const;
+
+    /** Set the sequence number the next programmed page will take
+     *
+     *  @param seq      Sequence number
+     */
+    void set_sequence(uint32_t seq);
+
+    /** Get the size of a readable block
+     *
+     *  @return         Size of a readable block in bytes
+     */
+    virtual bd_size_t get_read_size() const;
+
+    /** Get the size of a programable block
+     *
+     *  @return         Size of a programable block in bytes
+     *  @note Must be a multiple of the read size
+     */
+    virtual bd_size_t get_program_size() const;
+
+    /** Get the size of a eraseable block
+     *
+     *  @return         Size of a eraseable block in bytes
+     *  @note Must be a multiple of the program size
+     */
+    virtual bd_size_t get_erase_size() const;
+
+    /** Get the value of storage when erased
+     *
+     *  @return         The value of storage when erased
+     */
+    virtual int get_erase_value() const;
+
+    /** Get the total size of the underlying device
+     *
+     *  @return         Size of the underlying device in bytes
+     */
+    virtual bd_size_t size() const;
+
+private:
+    BlockDevice *_bd;
+    uint32_t _seq;
+    uint8_t _page[PAGE_HEADER_PAGE_SIZE];
+
+    // Internal functions
+    bd_addr_t _phys(bd_addr_t addr) const;
+    uint32_t _crc(uint32_t seq, const uint8_t *data) const;
+};
+
+
+#endif  /* MBED_PAGE_HEADER_BLOCK_DEVICE_H */
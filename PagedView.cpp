@@ -0,0 +1,168 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 2018 GreenWaves Technologies
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "PagedView.h"
+
+// Unmapped page in the table and empty frame
+#define PAGED_VIEW_NO_FRAME 0xFFFF
+#define PAGED_VIEW_NO_PAGE  0xFFFFFFFF
+
+
+PagedView::PagedView(BlockDevice *bd, bd_addr_t addr, bd_size_t size,
+                     void *frames, bd_size_t page_size, int frame_count) :
+    _bd(bd), _addr(addr), _size(size), _memory(static_cast<uint8_t*>(frames)),
+    _page_size(page_size), _frame_count(frame_count), _table(NULL), _frames(NULL),
+    _hand(0), _faults(0)
+{
+    MBED_ASSERT(page_size && (page_size & (page_size - 1)) == 0);
+    MBED_ASSERT(frame_count > 0 && frame_count < PAGED_VIEW_NO_FRAME);
+    MBED_ASSERT((size + page_size - 1) / page_size < PAGED_VIEW_NO_PAGE);
+}
+
+PagedView::~PagedView()
+{
+    deinit();
+}
+
+int PagedView::init()
+{
+    MBED_ASSERT(_addr % _bd->get_read_size() == 0 && _page_size % _bd->get_read_size() == 0);
+
+    uint32_t pages = (_size + _page_size - 1) / _page_size;
+
+    if (!_table) {
+        _table = new (std::nothrow) uint16_t[pages];
+    }
+    if (!_frames) {
+        _frames = new (std::nothrow) frame[_frame_count];
+    }
+    if (!_table || !_frames) {
+        deinit();
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    for (uint32_t i = 0; i < pages; i++) {
+        _table[i] = PAGED_VIEW_NO_FRAME;
+    }
+    for (int i = 0; i < _frame_count; i++) {
+        _frames[i].page = PAGED_VIEW_NO_PAGE;
+        _frames[i].referenced = false;
+    }
+    _hand = 0;
+
+    return 0;
+}
+
+int PagedView::deinit()
+{
+    delete[] _table;
+    _table = NULL;
+    delete[] _frames;
+    _frames = NULL;
+
+    return 0;
+}
+
+int PagedView::_fault(uint32_t page)
+{
+    // Clock, skip frames referenced since the hand last passed them
+    while (_frames[_hand].page != PAGED_VIEW_NO_PAGE && _frames[_hand].referenced) {
+        _frames[_hand].referenced = false;
+        _hand = (_hand + 1) % _frame_count;
+    }
+
+    int f = _hand;
+    _hand = (_hand + 1) % _frame_count;
+
+    if (_frames[f].page != PAGED_VIEW_NO_PAGE) {
+        _table[_frames[f].page] = PAGED_VIEW_NO_FRAME;
+        _frames[f].page = PAGED_VIEW_NO_PAGE;
+    }
+
+    // The last page may be cut short by the end of the range, reads still
+    // cover whole read blocks of the device
+    bd_addr_t off = (bd_addr_t)page * _page_size;
+    bd_size_t size = (off + _page_size < _size) ? _page_size : (_size - off);
+    bd_size_t read_size = _bd->get_read_size();
+    size = (size + read_size - 1) / read_size * read_size;
+
+    int err = _bd->read(&_memory[f * _page_size], _addr + off, size);
+    if (err) {
+        return err;
+    }
+
+    _frames[f].page = page;
+    _frames[f].referenced = true;
+    _table[page] = f;
+    _faults += 1;
+
+    return 0;
+}
+
+int PagedView::map(bd_addr_t offset, const void **ptr, bd_size_t *avail)
+{
+    MBED_ASSERT(_table && offset < _size);
+
+    uint32_t page = offset / _page_size;
+    if (_table[page] == PAGED_VIEW_NO_FRAME) {
+        int err = _fault(page);
+        if (err) {
+            return err;
+        }
+    }
+
+    int f = _table[page];
+    _frames[f].referenced = true;
+
+    bd_size_t off = offset % _page_size;
+    *ptr = &_memory[f * _page_size + off];
+    if (avail) {
+        *avail = (offset - off + _page_size < _size) ? (_page_size - off) : (_size - offset);
+    }
+
+    return 0;
+}
+
+int PagedView::read(bd_addr_t offset, void *buffer, bd_size_t size)
+{
+    MBED_ASSERT(offset + size <= _size);
+
+    while (size > 0) {
+        const void *ptr;
+        bd_size_t chunk;
+
+        int err = map(offset, &ptr, &chunk);
+        if (err) {
+            return err;
+        }
+
+        if (chunk > size) {
+            chunk = size;
+        }
+        memcpy(buffer, ptr, chunk);
+
+        buffer = static_cast<uint8_t*>(buffer) + chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+
+    return 0;
+}
+
+uint32_t PagedView::get_faults() const
+{
+    return _faults;
+}
@@ -0,0 +1,136 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 2018 GreenWaves Technologies
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MBED_PAGED_VIEW_H
+#define MBED_PAGED_VIEW_H
+
+#include <mbed.h>
+#include "BlockDevice.h"
+
+
+/** Demand paged, read-only view of a range of a block device
+ *
+ *  Large read-only tables are accessed through a small pool of RAM
+ *  frames instead of being loaded whole. A software page table maps
+ *  every page of the range to the frame holding it, and the first access
+ *  to a page faults it in with a single read(). When all frames are in
+ *  use, the clock algorithm picks a page that wasn't referenced recently
+ *  to replace.
+ *
+ *  @code
+ *  static uint8_t frames[8][512];
+ *  PagedView vocab(&hyperbusf, vocab_addr, vocab_size, frames, 512, 8);
+ *  vocab.init();
+ *
+ *  uint32_t entry;
+ *  vocab.get(index * sizeof(entry), &entry);
+ *  @endcode
+ *
+ *  @note Synchronization level: not protected
+ */
+class PagedView {
+public:
+    /** Creates a PagedView over a range of a block device
+     *
+     *  @param bd           Block device holding the data, already initialized
+     *  @param addr         Address of the range
+     *  @param size         Size of the range
+     *  @param frames       Memory holding frame_count frames of page_size bytes
+     *  @param page_size    Size of a page, a power of two such as 512 or 4096,
+     *                      and a multiple of the read size of the device
+     *  @param frame_count  Number of frames
+     */
+    PagedView(BlockDevice *bd, bd_addr_t addr, bd_size_t size,
+              void *frames, bd_size_t page_size, int frame_count);
+
+    /** Lifetime of the view
+     */
+    ~PagedView();
+
+    /** Allocate the page table, every page starts unmapped
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    int init();
+
+    /** Release the page table
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    int deinit();
+
+    /** Map the page holding an offset
+     *
+     *  The pointer stays valid until the next access to the view.
+     *
+     *  @param offset   Offset in the range
+     *  @param ptr      Returns a pointer to the data at offset
+     *  @param avail    Returns the number of bytes readable at ptr, may be NULL
+     *  @return         0 on success or a negative error code on failure
+     */
+    int map(bd_addr_t offset, const void **ptr, bd_size_t *avail = NULL);
+
+    /** Copy data out of the range
+     *
+     *  @param offset   Offset in the range
+     *  @param buffer   Buffer to copy to
+     *  @param size     Size to copy
+     *  @return         0 on success or a negative error code on failure
+     */
+    int read(bd_addr_t offset, void *buffer, bd_size_t size);
+
+    /** Read a value out of the range
+     *
+     *  @param offset   Offset of the value in the range
+     *  @param value    Returns the value
+     *  @return         0 on success or a negative error code on failure
+     */
+    template <typename T>
+    int get(bd_addr_t offset, T *value)
+    {
+        return read(offset, value, sizeof(T));
+    }
+
+    /** Get the number of page faults taken so far
+     *
+     *  @return         Number of pages read from the device
+     */
+    uint32_t get_faults() const;
+
+private:
+    struct frame {
+        uint32_t page;
+        bool referenced;
+    };
+
+    BlockDevice *_bd;
+    bd_addr_t _addr;
+    bd_size_t _size;
+    uint8_t *_memory;
+    bd_size_t _page_size;
+    int _frame_count;
+
+    uint16_t *_table;
+    frame *_frames;
+    int _hand;
+    uint32_t _faults;
+
+    // Internal functions
+    int _fault(uint32_t page);
+};
+
+
+#endif  /* MBED_PAGED_VIEW_H */
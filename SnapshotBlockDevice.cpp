@@ -0,0 +1,435 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 2018 GreenWaves Technologies
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SnapshotBlockDevice.h"
+
+/*
+|+-+-+-+-+-+-+-+-|
+|    TABLE  0    |  records appended until full
+|+-+-+-+-+-+-+-+-|
+|    TABLE  1    |  then continued here after an erase
+|+-+-+-+-+-+-+-+-|
+|   SECTOR  0    |
+|+-+-+-+-+-+-+-+-|
+|      ...       |  mapped through the active or frozen table
+|+-+-+-+-+-+-+-+-|
+*/
+
+#define SNAPSHOT_TABLES     2
+#define SNAPSHOT_MAGIC      0x50414e53  // "SNAP"
+#define SNAPSHOT_NONE       0xFFFF
+
+// Record header, followed by the active and frozen tables and a CRC
+struct snapshot_header {
+    uint32_t magic;
+    uint32_t seq;
+    uint16_t sectors;
+    uint16_t snapshot;
+};
+
+
+SnapshotBlockDevice::SnapshotBlockDevice(BlockDevice *bd, bd_size_t size) :
+    _bd(bd), _size(size), _sector_size(0), _logical(0), _physical(0),
+    _active(NULL), _frozen(NULL), _refs(NULL), _snapshot(false),
+    _seq(0), _table(0), _slot(0), _record_size(0), _record(NULL)
+{
+}
+
+SnapshotBlockDevice::~SnapshotBlockDevice()
+{
+    // The underlying device is left to whoever owns it
+    _free();
+}
+
+void SnapshotBlockDevice::_free()
+{
+    delete[] _active;
+    delete[] _frozen;
+    delete[] _refs;
+    delete[] _record;
+    _active = NULL;
+    _frozen = NULL;
+    _refs = NULL;
+    _record = NULL;
+}
+
+bd_addr_t SnapshotBlockDevice::_addr(uint16_t sector) const
+{
+    return (bd_addr_t)(SNAPSHOT_TABLES + sector) * _sector_size;
+}
+
+int SnapshotBlockDevice::init()
+{
+    int err = _bd->init();
+    if (err) {
+        return err;
+    }
+
+    _sector_size = _bd->get_erase_size();
+    _logical = _size / _sector_size;
+    _physical = _bd->size() / _sector_size - SNAPSHOT_TABLES;
+
+    MBED_ASSERT(_size % _sector_size == 0);
+    MBED_ASSERT(_sector_size % SNAPSHOT_COPY_SIZE == 0);
+    MBED_ASSERT(_logical < _physical && _physical < SNAPSHOT_NONE);
+
+    // Records are padded to what the device can program
+    bd_size_t program_size = _bd->get_program_size();
+    _record_size = sizeof(struct snapshot_header) + 2 * _logical * sizeof(uint16_t) + sizeof(uint32_t);
+    _record_size = (_record_size + program_size - 1) / program_size * program_size;
+
+    _active = new (std::nothrow) uint16_t[_logical];
+    _frozen = new (std::nothrow) uint16_t[_logical];
+    _refs = new (std::nothrow) uint8_t[_physical];
+    _record = new (std::nothrow) uint8_t[_record_size];
+    if (!_active || !_frozen || !_refs || !_record) {
+        deinit();
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    err = _load();
+    if (err) {
+        deinit();
+        return err;
+    }
+
+    return 0;
+}
+
+int SnapshotBlockDevice::deinit()
+{
+    _free();
+
+    return _bd->deinit();
+}
+
+int SnapshotBlockDevice::sync()
+{
+    return _bd->sync();
+}
+
+void SnapshotBlockDevice::_count_refs()
+{
+    memset(_refs, 0, _physical);
+
+    for (uint32_t i = 0; i < _logical; i++) {
+        _refs[_active[i]] += 1;
+        if (_snapshot && _frozen[i] != _active[i]) {
+            _refs[_frozen[i]] += 1;
+        }
+    }
+}
+
+static uint32_t snapshot_crc(const void *buffer, bd_size_t size)
+{
+    MbedCRC<POLY_32BIT_ANSI, 32> ct;
+    uint32_t crc = 0;
+    ct.compute(buffer, size, &crc);
+    return crc;
+}
+
+int SnapshotBlockDevice::_load()
+{
+    struct snapshot_header *header = (struct snapshot_header *)_record;
+    uint16_t *active = (uint16_t *)&header[1];
+    uint16_t *frozen = &active[_logical];
+    bd_size_t crc_off = (uint8_t *)&frozen[_logical] - _record;
+    uint32_t slots = _sector_size / _record_size;
+
+    bool found = false;
+    for (uint32_t t = 0; t < SNAPSHOT_TABLES; t++) {
+        uint32_t slot = 0;
+        for (; slot < slots; slot++) {
+            int err = _bd->read(_record, t * _sector_size + slot * _record_size, _record_size);
+            if (err) {
+                return err;
+            }
+
+            if (header->magic == 0xFFFFFFFF) {
+                break;
+            }
+
+            // Torn records are skipped, a newer one may follow
+            uint32_t crc;
+            memcpy(&crc, &_record[crc_off], sizeof(crc));
+            if (header->magic != SNAPSHOT_MAGIC || header->sectors != _logical ||
+                    crc != snapshot_crc(_record, crc_off)) {
+                continue;
+            }
+
+            if (!found || header->seq > _seq) {
+                found = true;
+                _seq = header->seq;
+                _table = t;
+                _snapshot = header->snapshot;
+                memcpy(_active, active, _logical * sizeof(uint16_t));
+                memcpy(_frozen, frozen, _logical * sizeof(uint16_t));
+            }
+        }
+
+        if (found && _table == t) {
+            _slot = slot;
+        }
+    }
+
+    if (!found) {
+        // Fresh device, map every sector onto itself
+        for (uint32_t i = 0; i < _logical; i++) {
+            _active[i] = i;
+            _frozen[i] = SNAPSHOT_NONE;
+        }
+        _snapshot = false;
+        _seq = 0;
+        _table = 0;
+        _slot = 0;
+
+        int err = _bd->erase(0, _sector_size);
+        if (err) {
+            return err;
+        }
+
+        _count_refs();
+        return _persist();
+    }
+
+    _count_refs();
+    return 0;
+}
+
+int SnapshotBlockDevice::_persist()
+{
+    struct snapshot_header *header = (struct snapshot_header *)_record;
+    uint16_t *active = (uint16_t *)&header[1];
+    uint16_t *frozen = &active[_logical];
+    bd_size_t crc_off = (uint8_t *)&frozen[_logical] - _record;
+
+    memset(_record, 0xFF, _record_size);
+    header->magic = SNAPSHOT_MAGIC;
+    header->seq = ++_seq;
+    header->sectors = _logical;
+    header->snapshot = _snapshot;
+    memcpy(active, _active, _logical * sizeof(uint16_t));
+    memcpy(frozen, _frozen, _logical * sizeof(uint16_t));
+
+    uint32_t crc = snapshot_crc(_record, crc_off);
+    memcpy(&_record[crc_off], &crc, sizeof(crc));
+
+    // Move on to the other table once this one is full, the last record
+    // of the old table stays valid until the new one is written
+    if ((_slot + 1) * _record_size > _sector_size) {
+        _table = (_table + 1) % SNAPSHOT_TABLES;
+        _slot = 0;
+
+        int err = _bd->erase(_table * _sector_size, _sector_size);
+        if (err) {
+            return err;
+        }
+    }
+
+    int err = _bd->program(_record, _table * _sector_size + _slot * _record_size, _record_size);
+    if (err) {
+        return err;
+    }
+
+    _slot += 1;
+    return 0;
+}
+
+int SnapshotBlockDevice::_unshare(uint32_t sector, bool copy)
+{
+    if (!_snapshot || _active[sector] != _frozen[sector]) {
+        return 0;
+    }
+
+    uint32_t dst = 0;
+    while (dst < _physical && _refs[dst]) {
+        dst++;
+    }
+
+    if (dst == _physical) {
+        return SNAPSHOT_BD_ERROR_NO_SPACE;
+    }
+
+    int err = _bd->erase(_addr(dst), _sector_size);
+    if (err) {
+        return err;
+    }
+
+    // Bring over what was already programmed, erased chunks are skipped
+    int erase_value = _bd->get_erase_value();
+    for (bd_size_t off = 0; copy && off < _sector_size; off += SNAPSHOT_COPY_SIZE) {
+        err = _bd->read(_page, _addr(_active[sector]) + off, SNAPSHOT_COPY_SIZE);
+        if (err) {
+            return err;
+        }
+
+        bool blank = erase_value >= 0;
+        for (int i = 0; blank && i < SNAPSHOT_COPY_SIZE; i++) {
+            blank = _page[i] == (uint8_t)erase_value;
+        }
+
+        if (!blank) {
+            err = _bd->program(_page, _addr(dst) + off, SNAPSHOT_COPY_SIZE);
+            if (err) {
+                return err;
+            }
+        }
+    }
+
+    _active[sector] = dst;
+    _refs[dst] += 1;
+
+    return _persist();
+}
+
+int SnapshotBlockDevice::read(void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    // Check the address and size fit onto the chip.
+    MBED_ASSERT(is_valid_read(addr, size));
+
+    while (size > 0) {
+        uint32_t sector = addr / _sector_size;
+        bd_size_t off = addr % _sector_size;
+        bd_size_t chunk = (off + size < _sector_size) ? size : (_sector_size - off);
+
+        int err = _bd->read(buffer, _addr(_active[sector]) + off, chunk);
+        if (err) {
+            return err;
+        }
+
+        buffer = static_cast<uint8_t*>(buffer) + chunk;
+        addr += chunk;
+        size -= chunk;
+    }
+
+    return 0;
+}
+
+int SnapshotBlockDevice::program(const void *buffer, bd_addr_t addr, bd_size_t size)
+{
+    // Check the address and size fit onto the chip.
+    MBED_ASSERT(is_valid_program(addr, size));
+
+    while (size > 0) {
+        uint32_t sector = addr / _sector_size;
+        bd_size_t off = addr % _sector_size;
+        bd_size_t chunk = (off + size < _sector_size) ? size : (_sector_size - off);
+
+        int err = _unshare(sector, true);
+        if (err) {
+            return err;
+        }
+
+        err = _bd->program(buffer, _addr(_active[sector]) + off, chunk);
+        if (err) {
+            return err;
+        }
+
+        buffer = static_cast<const uint8_t*>(buffer) + chunk;
+        addr += chunk;
+        size -= chunk;
+    }
+
+    return 0;
+}
+
+int SnapshotBlockDevice::erase(bd_addr_t addr, bd_size_t size)
+{
+    // Check the address and size fit onto the chip.
+    MBED_ASSERT(is_valid_erase(addr, size));
+
+    while (size > 0) {
+        uint32_t sector = addr / _sector_size;
+
+        // A frozen sector is replaced by a freshly erased one
+        int err;
+        if (_snapshot && _active[sector] == _frozen[sector]) {
+            err = _unshare(sector, false);
+        } else {
+            err = _bd->erase(_addr(_active[sector]), _sector_size);
+        }
+        if (err) {
+            return err;
+        }
+
+        addr += _sector_size;
+        size -= _sector_size;
+    }
+
+    return 0;
+}
+
+int SnapshotBlockDevice::snapshot()
+{
+    memcpy(_frozen, _active, _logical * sizeof(uint16_t));
+    _snapshot = true;
+    _count_refs();
+
+    return _persist();
+}
+
+int SnapshotBlockDevice::rollback()
+{
+    if (!_snapshot) {
+        return SNAPSHOT_BD_ERROR_NO_SNAPSHOT;
+    }
+
+    memcpy(_active, _frozen, _logical * sizeof(uint16_t));
+    _count_refs();
+
+    return _persist();
+}
+
+int SnapshotBlockDevice::commit()
+{
+    for (uint32_t i = 0; i < _logical; i++) {
+        _frozen[i] = SNAPSHOT_NONE;
+    }
+    _snapshot = false;
+    _count_refs();
+
+    return _persist();
+}
+
+bool SnapshotBlockDevice::has_snapshot() const
+{
+    return _snapshot;
+}
+
+bd_size_t SnapshotBlockDevice::get_read_size() const
+{
+    return _bd->get_read_size();
+}
+
+bd_size_t SnapshotBlockDevice::get_program_size() const
+{
+    return _bd->get_program_size();
+}
+
+bd_size_t SnapshotBlockDevice::get_erase_size() const
+{
+    return _bd->get_erase_size();
+}
+
+bd_size_t SnapshotBlockDevice::size() const
+{
+    return _size;
+}
+
+int SnapshotBlockDevice::get_erase_value() const
+{
+    return _bd->get_erase_value();
+}
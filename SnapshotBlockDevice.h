@@ -0,0 +1,218 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 2018 GreenWaves Technologies
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MBED_SNAPSHOT_BLOCK_DEVICE_H
+#define MBED_SNAPSHOT_BLOCK_DEVICE_H
+
+#include <mbed.h>
+#include "BlockDevice.h"
+
+
+// Size of the chunks moved when a frozen sector is copied
+#define SNAPSHOT_COPY_SIZE  512
+
+enum {
+    SNAPSHOT_BD_ERROR_NO_SPACE    = -4401, /*!< no free sector left for copy-on-write */
+    SNAPSHOT_BD_ERROR_NO_SNAPSHOT = -4402, /*!< no snapshot to roll back to */
+};
+
+/** Block device with copy-on-write snapshots
+ *
+ *  Logical erase sectors are mapped onto the physical sectors of the
+ *  underlying device through a table kept in RAM and persisted in two
+ *  alternating table sectors at the start of the device. Taking a
+ *  snapshot only freezes the current table. The first erase or program
+ *  of a frozen sector afterwards moves that sector to a free physical
+ *  sector, leaving the frozen copy untouched, so rolling back is just
+ *  restoring the frozen table.
+ *
+ *  The physical sectors beyond the exported size are the room available
+ *  to copy-on-write, they bound how much can change while a snapshot is
+ *  held.
+ *
+ *  @code
+ *  HYPERBUSFBlockDevice hyperbusf(...);
+ *  SnapshotBlockDevice snap(&hyperbusf, 16 * hyperbusf.get_erase_size());
+ *
+ *  snap.init();
+ *  snap.snapshot();
+ *  int err = apply_update(&snap);
+ *  if (err) {
+ *      snap.rollback();
+ *  } else {
+ *      snap.commit();
+ *  }
+ *  @endcode
+ *
+ *  @note Synchronization level: not protected
+ */
+class SnapshotBlockDevice : public BlockDevice {
+public:
+    /** Creates a SnapshotBlockDevice on top of another block device
+     *
+     *  @param bd       Block device to back the SnapshotBlockDevice
+     *  @param size     Size exported by the SnapshotBlockDevice, a multiple
+     *                  of the erase size leaving at least two table sectors
+     *                  and one free sector on the underlying device
+     */
+    SnapshotBlockDevice(BlockDevice *bd, bd_size_t size);
+
+    /** Lifetime of the block device
+     */
+    virtual ~SnapshotBlockDevice();
+
+    /** Initialize a block device
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int init();
+
+    /** Deinitialize a block device
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int deinit();
+
+    /** Ensure data on storage is in sync with the driver
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int sync();
+
+    /** Read blocks from a block device
+     *
+     *  @param buffer   Buffer to write blocks to
+     *  @param addr     Address of block to begin reading from
+     *  @param size     Size to read in bytes, must be a multiple of read block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int read(void *buffer, bd_addr_t addr, bd_size_t size);
+
+    /** Program blocks to a block device
+     *
+     *  The blocks must have been erased prior to being programmed
+     *
+     *  @param buffer   Buffer of data to write to blocks
+     *  @param addr     Address of block to begin writing to
+     *  @param size     Size to write in bytes, must be a multiple of program block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size);
+
+    /** Erase blocks on a block device
+     *
+     *  The state of an erased block is undefined until it has been programmed
+     *
+     *  @param addr     Address of block to begin erasing
+     *  @param size     Size to erase in bytes, must be a multiple of erase block size
+     *  @return         0 on success, negative error code on failure
+     */
+    virtual int erase(bd_addr_t addr, bd_size_t size);
+
+    /** Freeze the current contents of the device
+     *
+     *  Replaces any snapshot already held.
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    int snapshot();
+
+    /** Return the device to the contents it had when snapshot() was called
+     *
+     *  The snapshot is kept, so it can be rolled back to again.
+     *
+     *  @return         0 on success, SNAPSHOT_BD_ERROR_NO_SNAPSHOT if
+     *                  there is none, negative error code on failure
+     */
+    int rollback();
+
+    /** Drop the snapshot and keep the current contents
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    int commit();
+
+    /** Check if a snapshot is held
+     *
+     *  @return         True if rollback() can be used
+     */
+    bool has_snapshot() const;
+
+    /** Get the size of a readable block
+     *
+     *  @return         Size of a readable block in bytes
+     */
+    virtual bd_size_t get_read_size() const;
+
+    /** Get the size of a programable block
+     *
+     *  @return         Size of a programable block in bytes
+     *  @note Must be a multiple of the read size
+     */
+    virtual bd_size_t get_program_size() const;
+
+    /** Get the size of a eraseable block
+     *
+     *  @return         Size of a eraseable block in bytes
+     *  @note Must be a multiple of the program size
+     */
+    virtual bd_size_t get_erase_size() const;
+
+    /** Get the value of storage when erased
+     *
+     *  @return         The value of storage when erased
+     */
+    virtual int get_erase_value() const;
+
+    /** Get the total size of the underlying device
+     *
+     *  @return         Size of the underlying device in bytes
+     */
+    virtual bd_size_t size() const;
+
+private:
+    BlockDevice *_bd;
+    bd_size_t _size;
+    bd_size_t _sector_size;
+    uint32_t _logical;
+    uint32_t _physical;
+
+    // Mapping tables, physical sectors exclude the two table sectors
+    uint16_t *_active;
+    uint16_t *_frozen;
+    uint8_t *_refs;
+    bool _snapshot;
+
+    // Position of the next table record
+    uint32_t _seq;
+    uint32_t _table;
+    uint32_t _slot;
+    bd_size_t _record_size;
+    uint8_t *_record;
+
+    uint8_t _page[SNAPSHOT_COPY_SIZE];
+
+    // Internal functions
+    bd_addr_t _addr(uint16_t sector) const;
+    void _count_refs();
+    void _free();
+    int _load();
+    int _persist();
+    int _unshare(uint32_t sector, bool copy);
+};
+
+
+#endif  /* MBED_SNAPSHOT_BLOCK_DEVICE_H */
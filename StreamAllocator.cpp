@@ -0,0 +1,499 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 2018 GreenWaves Technologies
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "StreamAllocator.h"
+
+#define STREAM_COUNT        MBED_CONF_HYPERBUSF_DRIVER_STREAMS
+#define STREAM_GC_RESERVE   MBED_CONF_HYPERBUSF_DRIVER_GC_RESERVE_SECTORS
+#define STREAM_WL_THRESHOLD MBED_CONF_HYPERBUSF_DRIVER_WEAR_LEVEL_THRESHOLD
+#define STREAM_WL_RATE      MBED_CONF_HYPERBUSF_DRIVER_WEAR_LEVEL_RATE
+
+// Sector header, the stream is programmed separately when the sector is opened
+#define STREAM_MAGIC        0x31525453  // "STR1"
+#define STREAM_FREE         0xFF
+
+struct stream_header {
+    uint32_t magic;
+    uint32_t erase_count;
+    uint16_t stream;
+    uint16_t reserved;
+};
+
+
+StreamAllocator::StreamAllocator(HYPERBUSFBlockDevice *bd, bd_addr_t start, bd_size_t size) :
+    _bd(bd), _start(start), _free_count(0), _sectors(NULL),
+    _wl_budget(0), _wl_time(0)
+{
+    _sector_size = bd->get_erase_size();
+    _sector_count = size / _sector_size;
+    _sector_pages = _sector_size / HYPERBUS_PAGE_SIZE;
+
+    MBED_ASSERT(start % _sector_size == 0 && size % _sector_size == 0);
+    MBED_ASSERT(_sector_pages <= STREAM_ALLOCATOR_SECTOR_PAGES);
+    MBED_ASSERT(_sector_count > STREAM_GC_RESERVE);
+
+    for (int i = 0; i < STREAM_COUNT; i++) {
+        _open[i] = -1;
+    }
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+StreamAllocator::~StreamAllocator()
+{
+    delete[] _sectors;
+}
+
+bd_addr_t StreamAllocator::_addr(uint32_t sector, uint32_t page) const
+{
+    return _start + sector * _sector_size + page * HYPERBUS_PAGE_SIZE;
+}
+
+int StreamAllocator::init()
+{
+    if (!_sectors) {
+        _sectors = new (std::nothrow) struct sector[_sector_count];
+        if (!_sectors) {
+            return BD_ERROR_DEVICE_ERROR;
+        }
+    }
+
+    _free_count = 0;
+    for (int i = 0; i < STREAM_COUNT; i++) {
+        _open[i] = -1;
+    }
+
+    _wl_budget = 0;
+    _wl_time = Kernel::get_ms_count();
+
+    // Erased pages were never written, they aren't kept on mount
+    uint32_t page[HYPERBUS_PAGE_SIZE / sizeof(uint32_t)];
+
+    for (uint32_t s = 0; s < _sector_count; s++) {
+        struct sector *sector = &_sectors[s];
+        struct stream_header header;
+
+        int err = _bd->read(&header, _addr(s, 0), sizeof(header));
+        if (err) {
+            return err;
+        }
+
+        memset(sector->map, 0, sizeof(sector->map));
+
+        if (header.magic != STREAM_MAGIC) {
+            // Never formatted, nothing valid to keep
+            sector->erase_count = 0;
+            sector->stream = 0;
+            sector->valid = 0;
+            sector->next = _sector_pages;
+        } else if (header.stream == 0xFFFF) {
+            sector->erase_count = header.erase_count;
+            sector->stream = STREAM_FREE;
+            sector->valid = 0;
+            sector->next = 1;
+            _free_count++;
+        } else {
+            // Closed on mount, written pages stay valid until released
+            sector->erase_count = header.erase_count;
+            sector->stream = header.stream % STREAM_COUNT;
+            sector->valid = 0;
+            sector->next = _sector_pages;
+
+            for (uint32_t p = 1; p < _sector_pages; p++) {
+                err = _bd->read(page, _addr(s, p), sizeof(page));
+                if (err) {
+                    return err;
+                }
+
+                for (uint32_t i = 0; i < sizeof(page) / sizeof(page[0]); i++) {
+                    if (page[i] != 0xFFFFFFFF) {
+                        _set_valid(_addr(s, p), 1, true);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+int StreamAllocator::deinit()
+{
+    delete[] _sectors;
+    _sectors = NULL;
+
+    return 0;
+}
+
+int StreamAllocator::format()
+{
+    int err = init();
+    if (err) {
+        return err;
+    }
+
+    _free_count = 0;
+    for (uint32_t s = 0; s < _sector_count; s++) {
+        err = _erase_sector(s);
+        if (err) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+int StreamAllocator::_erase_sector(uint32_t s)
+{
+    struct sector *sector = &_sectors[s];
+
+    int err = _bd->erase(_addr(s, 0), _sector_size);
+    if (err) {
+        return err;
+    }
+
+    sector->erase_count += 1;
+    _stats.erases += 1;
+
+    // Leave the stream erased so it can be programmed on open
+    struct stream_header header = { STREAM_MAGIC, sector->erase_count, 0xFFFF, 0xFFFF };
+    err = _bd->program(&header, _addr(s, 0), offsetof(struct stream_header, stream));
+    if (err) {
+        return err;
+    }
+
+    memset(sector->map, 0, sizeof(sector->map));
+    sector->valid = 0;
+    sector->next = 1;
+    sector->stream = STREAM_FREE;
+    _free_count += 1;
+
+    return 0;
+}
+
+int StreamAllocator::_open_sector(int stream)
+{
+    // Spread the erases by handing out the least worn free sector, sectors
+    // the device times as slow only when nothing else is left
+    int best = -1;
+    bool best_slow = false;
+    for (uint32_t s = 0; s < _sector_count; s++) {
+        if (_sectors[s].stream != STREAM_FREE) {
+            continue;
+        }
+
+        bool slow = _bd->is_slow_sector(_addr(s, 0));
+        if (best < 0 || (best_slow && !slow) ||
+                (slow == best_slow && _sectors[s].erase_count < _sectors[best].erase_count)) {
+            best = s;
+            best_slow = slow;
+        }
+    }
+
+    if (best < 0) {
+        return STREAM_ALLOCATOR_ERROR_NO_SPACE;
+    }
+
+    uint16_t id = stream;
+    int err = _bd->program(&id, _addr(best, 0) + offsetof(struct stream_header, stream), sizeof(id));
+    if (err) {
+        return err;
+    }
+
+    _sectors[best].stream = stream;
+    _free_count -= 1;
+    _open[stream] = best;
+
+    return 0;
+}
+
+int StreamAllocator::_alloc(int stream, uint32_t pages, bd_addr_t *addr)
+{
+    int s = _open[stream];
+    if (s < 0 || _sectors[s].next + pages > _sector_pages) {
+        int err = _open_sector(stream);
+        if (err) {
+            return err;
+        }
+        s = _open[stream];
+    }
+
+    *addr = _addr(s, _sectors[s].next);
+    _sectors[s].next += pages;
+
+    return 0;
+}
+
+void StreamAllocator::_set_valid(bd_addr_t addr, uint32_t pages, bool valid)
+{
+    struct sector *sector = &_sectors[(addr - _start) / _sector_size];
+    uint32_t page = ((addr - _start) % _sector_size) / HYPERBUS_PAGE_SIZE;
+
+    for (uint32_t i = page; i < page + pages; i++) {
+        uint32_t mask = 1UL << (i % 32);
+        bool set = sector->map[i / 32] & mask;
+
+        if (valid && !set) {
+            sector->map[i / 32] |= mask;
+            sector->valid += 1;
+        } else if (!valid && set) {
+            sector->map[i / 32] &= ~mask;
+            sector->valid -= 1;
+        }
+    }
+}
+
+int StreamAllocator::_pick_victim() const
+{
+    // Greedy, the sector with the least valid data costs the least to move
+    int best = -1;
+    for (uint32_t s = 0; s < _sector_count; s++) {
+        const struct sector *sector = &_sectors[s];
+        if (sector->stream == STREAM_FREE || _open[sector->stream] == (int)s) {
+            continue;
+        }
+
+        if (sector->valid < _sector_pages - 1 &&
+                (best < 0 || sector->valid < _sectors[best].valid)) {
+            best = s;
+        }
+    }
+
+    return best;
+}
+
+int StreamAllocator::_reclaim(uint32_t v)
+{
+    struct sector *victim = &_sectors[v];
+    int stream = victim->stream;
+
+    // Keep relocated data in its own stream so lifetimes stay grouped
+    uint32_t page = 1;
+    while (page < victim->next) {
+        if (!(victim->map[page / 32] & (1UL << (page % 32)))) {
+            page += 1;
+            continue;
+        }
+
+        uint32_t run = 1;
+        while (page + run < victim->next &&
+                (victim->map[(page + run) / 32] & (1UL << ((page + run) % 32)))) {
+            run += 1;
+        }
+
+        // A run may have to be split over the end of the open sector
+        int s = _open[stream];
+        uint32_t room = (s < 0) ? 0 : _sector_pages - _sectors[s].next;
+        if (room == 0) {
+            room = _sector_pages - 1;
+        }
+        if (run > room) {
+            run = room;
+        }
+
+        bd_addr_t dst;
+        int err = _alloc(stream, run, &dst);
+        if (err) {
+            return err;
+        }
+
+        err = _bd->copy(_addr(v, page), dst, run * HYPERBUS_PAGE_SIZE);
+        if (err) {
+            return err;
+        }
+
+        _set_valid(dst, run, true);
+        _stats.gc_bytes += run * HYPERBUS_PAGE_SIZE;
+
+        if (_relocate) {
+            _relocate(_addr(v, page), dst, run * HYPERBUS_PAGE_SIZE);
+        }
+
+        page += run;
+    }
+
+    _stats.gc_runs += 1;
+    return _erase_sector(v);
+}
+
+int StreamAllocator::gc()
+{
+    MBED_ASSERT(_sectors);
+
+    while (_free_count <= STREAM_GC_RESERVE) {
+        int victim = _pick_victim();
+        if (victim < 0) {
+            break;
+        }
+
+        int err = _reclaim(victim);
+        if (err) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+int StreamAllocator::write(int stream, const void *buffer, bd_size_t size, bd_addr_t *addr)
+{
+    MBED_ASSERT(_sectors);
+    MBED_ASSERT(stream >= 0 && stream < STREAM_COUNT);
+    MBED_ASSERT(size > 0 && size <= get_max_write_size());
+
+    uint32_t pages = (size + HYPERBUS_PAGE_SIZE - 1) / HYPERBUS_PAGE_SIZE;
+
+    if (_free_count <= STREAM_GC_RESERVE) {
+        int err = gc();
+        if (err) {
+            return err;
+        }
+    }
+
+    int err = _alloc(stream, pages, addr);
+    if (err) {
+        return err;
+    }
+
+    err = _bd->program(buffer, *addr, size);
+    if (err) {
+        return err;
+    }
+
+    _set_valid(*addr, pages, true);
+    _stats.host_bytes += pages * HYPERBUS_PAGE_SIZE;
+
+    return 0;
+}
+
+int StreamAllocator::release(bd_addr_t addr, bd_size_t size)
+{
+    MBED_ASSERT(_sectors);
+    MBED_ASSERT(addr >= _start && addr + size <= _start + _sector_count * _sector_size);
+
+    uint32_t pages = (size + HYPERBUS_PAGE_SIZE - 1) / HYPERBUS_PAGE_SIZE;
+    _set_valid(addr, pages, false);
+
+    return 0;
+}
+
+int StreamAllocator::_migrate(uint32_t src, uint32_t dst)
+{
+    struct sector *from = &_sectors[src];
+    struct sector *to = &_sectors[dst];
+
+    uint16_t id = from->stream;
+    int err = _bd->program(&id, _addr(dst, 0) + offsetof(struct stream_header, stream), sizeof(id));
+    if (err) {
+        return err;
+    }
+
+    to->stream = from->stream;
+    _free_count -= 1;
+
+    // Pages keep their offsets, the sector is moved as a whole and stays
+    // closed so the cold data doesn't get mixed with new appends
+    uint32_t page = 1;
+    while (page < from->next) {
+        if (!(from->map[page / 32] & (1UL << (page % 32)))) {
+            page += 1;
+            continue;
+        }
+
+        uint32_t run = 1;
+        while (page + run < from->next &&
+                (from->map[(page + run) / 32] & (1UL << ((page + run) % 32)))) {
+            run += 1;
+        }
+
+        err = _bd->copy(_addr(src, page), _addr(dst, page), run * HYPERBUS_PAGE_SIZE);
+        if (err) {
+            return err;
+        }
+
+        _stats.wl_bytes += run * HYPERBUS_PAGE_SIZE;
+
+        if (_relocate) {
+            _relocate(_addr(src, page), _addr(dst, page), run * HYPERBUS_PAGE_SIZE);
+        }
+
+        page += run;
+    }
+
+    memcpy(to->map, from->map, sizeof(to->map));
+    to->valid = from->valid;
+    to->next = _sector_pages;
+
+    _stats.wl_runs += 1;
+    return _erase_sector(src);
+}
+
+int StreamAllocator::wear_level()
+{
+    MBED_ASSERT(_sectors);
+
+    // Refill the budget, bursts are limited to one sector
+    uint64_t now = Kernel::get_ms_count();
+    _wl_budget += (now - _wl_time) * STREAM_WL_RATE / 1000;
+    if (_wl_budget > _sector_size) {
+        _wl_budget = _sector_size;
+    }
+    _wl_time = now;
+
+    // Coldest used sector and most worn free sector
+    int cold = -1;
+    int worn = -1;
+    for (uint32_t s = 0; s < _sector_count; s++) {
+        const struct sector *sector = &_sectors[s];
+        if (sector->stream == STREAM_FREE) {
+            if (worn < 0 || sector->erase_count > _sectors[worn].erase_count) {
+                worn = s;
+            }
+        } else if (_open[sector->stream] != (int)s) {
+            if (cold < 0 || sector->erase_count < _sectors[cold].erase_count) {
+                cold = s;
+            }
+        }
+    }
+
+    if (cold < 0 || worn < 0 ||
+            _sectors[worn].erase_count < _sectors[cold].erase_count + STREAM_WL_THRESHOLD) {
+        return 0;
+    }
+
+    uint64_t cost = _sectors[cold].valid * HYPERBUS_PAGE_SIZE;
+    if (cost > _wl_budget) {
+        return 0;
+    }
+    _wl_budget -= cost;
+
+    return _migrate(cold, worn);
+}
+
+void StreamAllocator::attach(Callback<void(bd_addr_t, bd_addr_t, bd_size_t)> func)
+{
+    _relocate = func;
+}
+
+bd_size_t StreamAllocator::get_max_write_size() const
+{
+    return (_sector_pages - 1) * HYPERBUS_PAGE_SIZE;
+}
+
+void StreamAllocator::get_stats(stream_allocator_stats_t *stats) const
+{
+    *stats = _stats;
+}
@@ -0,0 +1,190 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 2018 GreenWaves Technologies
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MBED_STREAM_ALLOCATOR_H
+#define MBED_STREAM_ALLOCATOR_H
+
+#include <mbed.h>
+#include "HYPERBUSFBlockDevice.h"
+
+// Largest number of pages in a sector
+#define STREAM_ALLOCATOR_SECTOR_PAGES   512
+
+enum {
+    STREAM_ALLOCATOR_ERROR_NO_SPACE = -4201, /*!< no free sector left after garbage collection */
+};
+
+/** Write amplification counters of a StreamAllocator
+ */
+typedef struct {
+    uint64_t host_bytes;    /*!< bytes written through write() */
+    uint64_t gc_bytes;      /*!< bytes relocated by garbage collection */
+    uint32_t erases;        /*!< sectors erased */
+    uint32_t gc_runs;       /*!< sectors reclaimed by garbage collection */
+    uint64_t wl_bytes;      /*!< bytes migrated by static wear leveling */
+    uint32_t wl_runs;       /*!< sectors migrated by static wear leveling */
+} stream_allocator_stats_t;
+
+/** Sector allocator separating data by expected lifetime
+ *
+ *  Every write carries a stream ID, and each stream appends into its own
+ *  open erase sector, so data with similar lifetimes ends up sharing
+ *  sectors. When short lived data dies, whole sectors become invalid
+ *  together and garbage collection has little left to copy.
+ *
+ *  Space is handed out in HYPERBUS_PAGE_SIZE pages. The first page of
+ *  each sector holds a header with its erase count and owning stream.
+ *  Garbage collection moves the valid pages of the emptiest sector with
+ *  HYPERBUSFBlockDevice::copy() and reports every move through the
+ *  relocation callback so the caller can update its index.
+ *
+ *  After a reboot every written page is considered valid again, the
+ *  caller is expected to release() the extents it no longer references
+ *  while replaying its index.
+ *
+ *  @note Synchronization level: not protected
+ */
+class StreamAllocator {
+public:
+    /** Creates a StreamAllocator over a region of a HYPERBUSFBlockDevice
+     *
+     *  @param bd       Device to allocate from
+     *  @param start    Address of the first sector of the region
+     *  @param size     Size of the region, a multiple of the erase size
+     */
+    StreamAllocator(HYPERBUSFBlockDevice *bd, bd_addr_t start, bd_size_t size);
+
+    /** Lifetime of the allocator
+     */
+    ~StreamAllocator();
+
+    /** Erase the whole region and write fresh sector headers
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    int format();
+
+    /** Mount the region by reading back the sector headers
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    int init();
+
+    /** Release the memory used by the allocator
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    int deinit();
+
+    /** Allocate space in a stream and program data into it
+     *
+     *  @param stream   Stream to append to, less than hyperbusf-driver.streams
+     *  @param buffer   Data to write
+     *  @param size     Size of the data, at most get_max_write_size()
+     *  @param addr     Returns the address the data was written to
+     *  @return         0 on success, STREAM_ALLOCATOR_ERROR_NO_SPACE when
+     *                  the region is full, negative error code on failure
+     */
+    int write(int stream, const void *buffer, bd_size_t size, bd_addr_t *addr);
+
+    /** Mark a previously written extent as no longer used
+     *
+     *  @param addr     Address returned by write()
+     *  @param size     Size passed to write()
+     *  @return         0 on success or a negative error code on failure
+     */
+    int release(bd_addr_t addr, bd_size_t size);
+
+    /** Reclaim sectors until enough of them are free
+     *
+     *  This also runs from write() when the free sectors run out.
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    int gc();
+
+    /** Run static wear leveling
+     *
+     *  Meant to be called periodically from an idle task. When the erase
+     *  counts drift further apart than hyperbusf-driver.wear-level-threshold,
+     *  the data of the least worn used sector is migrated into the most
+     *  worn free sector, which hands the barely used sector back to the
+     *  hot streams. Migrations are paced to hyperbusf-driver.wear-level-rate
+     *  bytes per second, calls made before enough budget accumulated
+     *  return without doing anything.
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    int wear_level();
+
+    /** Register a function called when garbage collection moves data
+     *
+     *  @param func     Called with the old address, the new address and
+     *                  the size of the moved extent
+     */
+    void attach(Callback<void(bd_addr_t, bd_addr_t, bd_size_t)> func);
+
+    /** Get the largest size accepted by write()
+     *
+     *  @return         Size in bytes
+     */
+    bd_size_t get_max_write_size() const;
+
+    /** Get the write amplification counters
+     *
+     *  Write amplification is (host_bytes + gc_bytes + wl_bytes) / host_bytes.
+     *
+     *  @param stats    Returns the counters
+     */
+    void get_stats(stream_allocator_stats_t *stats) const;
+
+private:
+    struct sector {
+        uint32_t erase_count;
+        uint16_t valid;
+        uint16_t next;
+        uint8_t stream;
+        uint32_t map[STREAM_ALLOCATOR_SECTOR_PAGES / 32];
+    };
+
+    HYPERBUSFBlockDevice *_bd;
+    bd_addr_t _start;
+    bd_size_t _sector_size;
+    uint32_t _sector_count;
+    uint32_t _sector_pages;
+    uint32_t _free_count;
+    struct sector *_sectors;
+    int _open[MBED_CONF_HYPERBUSF_DRIVER_STREAMS];
+    Callback<void(bd_addr_t, bd_addr_t, bd_size_t)> _relocate;
+    stream_allocator_stats_t _stats;
+
+    // Wear leveling budget in bytes, refilled over time
+    uint64_t _wl_budget;
+    uint64_t _wl_time;
+
+    // Internal functions
+    bd_addr_t _addr(uint32_t sector, uint32_t page) const;
+    int _erase_sector(uint32_t sector);
+    int _open_sector(int stream);
+    int _alloc(int stream, uint32_t pages, bd_addr_t *addr);
+    int _reclaim(uint32_t sector);
+    int _pick_victim() const;
+    int _migrate(uint32_t src, uint32_t dst);
+    void _set_valid(bd_addr_t addr, uint32_t pages, bool valid);
+};
+
+
+#endif  /* MBED_STREAM_ALLOCATOR_H */